@@ -12,24 +12,73 @@
  */
 #define PQNB_MAX_EVENTS 32
 /* 
- * queries buffer max entries
+ * queries buffer default max entries, see PQNB_OPT_QUEUE_CAPACITY
  */
 #define PQNB_MAX_QBUF 2048
+/*
+ * returned by the query functions when the queries buffer
+ * reached its capacity, the request wasn't taken
+ */
+#define PQNB_QUEUE_FULL (-2)
+/*
+ * returned by the query functions when the database is known to
+ * be down, no connection is up and connecting keeps failing
+ */
+#define PQNB_UNAVAILABLE (-3)
 /*
  * default timeout in seconds for connecting or reconnecting
  */
 #define PQNB_DEFAULT_CONNECT_TIMEOUT 5
 /*
- * query default timeout
+ * query default timeout in seconds, counted from the
+ * PQNB_pool_query call
  */
 #define PQNB_DEFAULT_QUERY_TIMEOUT 5
+/*
+ * reconnect backoff defaults in milliseconds, the delay doubles on
+ * each failed attempt and is randomized between half and all of it
+ */
+#define PQNB_DEFAULT_RECONNECT_BACKOFF_MS 100
+#define PQNB_DEFAULT_RECONNECT_BACKOFF_MAX_MS 10000
+/*
+ * default max connections (re)connecting at once
+ */
+#define PQNB_DEFAULT_MAX_RECONNECTS 4
+/*
+ * max in-flight queries per connection in pipeline mode
+ */
+#define PQNB_MAX_PIPELINE_DEPTH 64
+/*
+ * max prepared statements cached per connection
+ */
+#define PQNB_MAX_STATEMENT_CACHE 4096
+/*
+ * number of query classes, each one has its own queue
+ */
+#define PQNB_MAX_QUERY_CLASSES 8
+/*
+ * consecutive connection failures taking a replica out of rotation
+ */
+#define PQNB_HOST_MAX_FAILURES 3
 
 struct PQNB_pool;
 /**
+ * opens num_connections right away, 0 connects lazily once
+ * PQNB_OPT_MAX_CONNECTIONS is raised.
  * returns NULL on allocation errors / configuration problems
  */
 struct PQNB_pool *
 PQNB_pool_init(const char *conninfo, uint16_t num_connections);
+/**
+ * num_connections to the primary and to each replica, read-only
+ * queries are balanced over the replicas. Replicas failing to
+ * connect PQNB_HOST_MAX_FAILURES times in a row are left out
+ * until they connect again.
+ * returns NULL on allocation errors / configuration problems
+ */
+struct PQNB_pool *
+PQNB_pool_init_hosts(const char *primary, const char *const *replicas,
+                     uint16_t num_replicas, uint16_t num_connections);
 /*
  * deallocates everything
  */
@@ -40,12 +89,116 @@ PQNB_pool_free(struct PQNB_pool *pool);
  */
 int
 PQNB_pool_run(struct PQNB_pool *pool);
+/*
+ * number of latency histogram buckets
+ */
+#define PQNB_HISTOGRAM_BUCKETS 528
+/*
+ * log-linear latency histogram in nanoseconds, ~6% precision
+ * from 1us up, the last bucket takes anything above ~19 hours
+ */
+struct PQNB_histogram
+{
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[PQNB_HISTOGRAM_BUCKETS];
+};
+/*
+ * bucket upper bound for the percentile, from 0 to 100
+ */
+uint64_t
+PQNB_histogram_percentile(const struct PQNB_histogram *histogram,
+                          double percentile);
+/*
+ * pool statistics
+ */
+struct PQNB_pool_stats
+{
+    /*
+     * at the PQNB_pool_get_info call
+     */
+    uint32_t connections;
+    uint32_t idle;
+    uint32_t connecting;
+    uint32_t querying;
+    /*
+     * waiting for the reconnect backoff
+     */
+    uint32_t backoff;
+    uint32_t queued;
+    uint32_t in_flight;
+    /*
+     * counted since PQNB_pool_init
+     */
+    uint64_t submitted;
+    uint64_t completed;
+    /*
+     * requests failed by connection errors
+     */
+    uint64_t errors;
+    uint64_t timeouts;
+    /*
+     * cancel requests sent to the server
+     */
+    uint64_t cancels;
+    /*
+     * connections lost or failing to connect
+     */
+    uint64_t resets;
+    uint64_t connects;
+    /*
+     * submissions refused with PQNB_QUEUE_FULL / PQNB_UNAVAILABLE
+     */
+    uint64_t rejected;
+    uint64_t unavailable;
+    /*
+     * batches of more than one request, see PQNB_OPT_BATCH_SIZE
+     */
+    uint64_t batches;
+    /*
+     * PQNB_QUERY_CACHE queries answered from the result cache or
+     * not, and bytes held by the cached results
+     */
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_bytes;
+    /*
+     * NOTIFY messages received on subscribed channels
+     */
+    uint64_t notifications;
+    /*
+     * PQNB_QUERY_SINGLE_FLIGHT queries attached to an identical
+     * request instead of being submitted
+     */
+    uint64_t coalesced;
+    /*
+     * bytes of the PQNB_QUERY_COPY arena: taken from malloc,
+     * held by requests and the most ever held
+     */
+    uint64_t arena_reserved;
+    uint64_t arena_used;
+    uint64_t arena_peak;
+    /*
+     * submission to sent
+     */
+    struct PQNB_histogram queue_wait;
+    /*
+     * sent to the first result
+     */
+    struct PQNB_histogram first_result;
+    /*
+     * submission to completion
+     */
+    struct PQNB_histogram total;
+};
 /*
  * used for querying pool info
  */
 enum PQNB_pool_info_type
 {
     PQNB_INFO_EPOLL_FD = 0,
+    PQNB_INFO_STATS,
 };
 /*
  * pool info
@@ -53,12 +206,183 @@ enum PQNB_pool_info_type
 union PQNB_pool_info
 {
     int epoll_fd;
+    /*
+     * valid until the next pool call, latencies are measured
+     * with the clock of each PQNB_pool_run call
+     */
+    struct PQNB_pool_stats stats;
 };
 /*
  * NULL if not found
  */
 const union PQNB_pool_info *
 PQNB_pool_get_info(struct PQNB_pool *pool, enum PQNB_pool_info_type type);
+/*
+ * used for setting pool options
+ */
+enum PQNB_pool_option_type
+{
+    PQNB_OPT_PIPELINE_DEPTH = 0,
+    PQNB_OPT_STATEMENT_CACHE,
+    PQNB_OPT_CONNECT_TIMEOUT_MS,
+    PQNB_OPT_QUERY_TIMEOUT_MS,
+    PQNB_OPT_QUEUE_CAPACITY,
+    PQNB_OPT_QUEUE_WATERMARK,
+    PQNB_OPT_CLASS_WEIGHT,
+    PQNB_OPT_MIN_CONNECTIONS,
+    PQNB_OPT_MAX_CONNECTIONS,
+    PQNB_OPT_IDLE_TIMEOUT_MS,
+    PQNB_OPT_GROW_THRESHOLD,
+    PQNB_OPT_RECONNECT_BACKOFF_MS,
+    PQNB_OPT_RECONNECT_BACKOFF_MAX_MS,
+    PQNB_OPT_MAX_RECONNECTS,
+    PQNB_OPT_TRACE,
+    PQNB_OPT_BATCH_SIZE,
+    PQNB_OPT_RESULT_CACHE,
+};
+/*
+ * called with high set once the queued requests reach the high
+ * watermark, then with high unset once they drop to the low one
+ */
+typedef void (*PQNB_watermark_cb)(struct PQNB_pool *pool,
+                                  bool high,
+                                  size_t queued,
+                                  void *user_data);
+/*
+ * query lifecycle steps, in order. Requests failing or timing
+ * out skip the remaining ones
+ */
+enum PQNB_trace_event
+{
+    /*
+     * no connection could take it, it waits in the queue
+     */
+    PQNB_TRACE_ENQUEUED = 0,
+    /*
+     * handed to a connection
+     */
+    PQNB_TRACE_DISPATCHED,
+    /*
+     * fully written to the socket
+     */
+    PQNB_TRACE_FLUSHED,
+    /*
+     * first read of the response
+     */
+    PQNB_TRACE_FIRST_READ,
+    /*
+     * last result delivered
+     */
+    PQNB_TRACE_COMPLETED,
+};
+/*
+ * ns is CLOCK_MONOTONIC nanoseconds, user_data the query one.
+ * query is NULL for sessions waiting for a connection
+ */
+typedef void (*PQNB_trace_cb)(struct PQNB_pool *pool,
+                              enum PQNB_trace_event event,
+                              uint64_t ns,
+                              const char *query,
+                              void *user_data,
+                              void *trace_data);
+/*
+ * pool option value
+ */
+union PQNB_pool_option
+{
+    /*
+     * max in-flight queries per connection, up to
+     * PQNB_MAX_PIPELINE_DEPTH. Anything above 1 enables libpq
+     * pipeline mode, queries must then be a single statement
+     */
+    uint16_t pipeline_depth;
+    /*
+     * max requests a connection takes from the queues at once, up to
+     * PQNB_MAX_PIPELINE_DEPTH, pipelined and flushed together.
+     * Each one keeps its own sync, a failing query doesn't abort
+     * the others. Batches may exceed the pipeline depth, queries
+     * must be a single statement. 0 or 1 disables it, the default
+     */
+    uint16_t batch_size;
+    /*
+     * prepared statements cached per connection, up to
+     * PQNB_MAX_STATEMENT_CACHE, 0 disables the cache. Queries are
+     * then prepared on first use and executed by name afterwards,
+     * they must be a single statement
+     */
+    uint16_t statement_cache_size;
+    /*
+     * connect or default query timeout in milliseconds. For the
+     * idle timeout, connections above the minimum idle for longer
+     * are closed, 0 keeps them. Also the reconnect backoff bounds
+     */
+    uint32_t timeout_ms;
+    /*
+     * connections bounds per host, both default to the
+     * PQNB_pool_init count. Raising the minimum connects right
+     * away, lowering the maximum doesn't close connections.
+     * Also the max connections (re)connecting at once
+     */
+    uint16_t connections;
+    /*
+     * queued requests waiting before opening one more connection,
+     * on top of the connections already being opened. Defaults to 0
+     */
+    uint32_t grow_threshold;
+    /*
+     * max requests waiting for a connection, the buffer grows
+     * up to it. Lowering it doesn't drop queued requests
+     */
+    uint32_t queue_capacity;
+    /*
+     * backpressure signalling, low must be below high.
+     * A NULL callback disables it
+     */
+    struct
+    {
+        uint32_t high;
+        uint32_t low;
+        PQNB_watermark_cb cb;
+        void *user_data;
+    } watermark;
+    /*
+     * queued requests are dispatched by deficit round robin,
+     * a class gets up to weight requests per round. Defaults to 1
+     */
+    struct
+    {
+        uint8_t query_class;
+        uint16_t weight;
+    } class_weight;
+    /*
+     * PQNB_QUERY_CACHE results kept up to max_bytes, least recently
+     * used ones are evicted first. They expire ttl_ms after being
+     * received, 0 keeps them until evicted or invalidated. A 0
+     * max_bytes disables the cache, the default, and drops it
+     */
+    struct
+    {
+        size_t max_bytes;
+        uint32_t ttl_ms;
+    } result_cache;
+    /*
+     * lifecycle hook, NULL disables it. Only available when
+     * built with PQNB_TRACE defined (make TRACE=1), setting it
+     * fails otherwise
+     */
+    struct
+    {
+        PQNB_trace_cb cb;
+        void *user_data;
+    } trace;
+};
+/**
+ * returns 0 on success, -1 on unknown option / invalid value
+ */
+int
+PQNB_pool_set_option(struct PQNB_pool *pool,
+                     enum PQNB_pool_option_type type,
+                     const union PQNB_pool_option *option);
 /*
  * Don't call PQclear, we always call after calling this.
  * This function may be called multiple times
@@ -68,11 +392,438 @@ typedef void (*PQNB_query_cb)(PGresult *pg_result,
                               char *error_msg,
                               bool timeout);
 /**
- * returns 0 on success, -1 on error
+ * returns 0 on success, PQNB_QUEUE_FULL if no connection is
+ * available and the queue is full, PQNB_UNAVAILABLE if the database
+ * is down, -1 on error
  */
 int
 PQNB_pool_query(struct PQNB_pool *pool, const char *query,
                 PQNB_query_cb query_cb,
                 const void *user_data);
+/**
+ * same as PQNB_pool_query but sent with PQsendQueryParams, arguments
+ * follows libpq's. Params aren't copied, they must be kept alive until
+ * the callback is called. result_format 1 asks for binary results.
+ * returns like PQNB_pool_query
+ */
+int
+PQNB_pool_query_params(struct PQNB_pool *pool, const char *query,
+                       int num_params,
+                       const Oid *param_types,
+                       const char *const *param_values,
+                       const int *param_lengths,
+                       const int *param_formats,
+                       int result_format,
+                       PQNB_query_cb query_cb,
+                       const void *user_data);
+/*
+ * query flags
+ */
+enum PQNB_query_flag
+{
+    /*
+     * results are passed as they arrive, in PGRES_SINGLE_TUPLE
+     * or PGRES_TUPLES_CHUNK batches, followed by an empty
+     * PGRES_TUPLES_OK
+     */
+    PQNB_QUERY_STREAM = 1 << 0,
+    /*
+     * may run on a replica, the primary takes it if none
+     * is available
+     */
+    PQNB_QUERY_READ_ONLY = 1 << 1,
+    /*
+     * the query and params are copied into the pool, they may
+     * be freed once the call returns
+     */
+    PQNB_QUERY_COPY = 1 << 2,
+    /*
+     * answered right away, from PQNB_pool_query_ex, when the same
+     * query and params were cached, a PGRES_TUPLES_OK result is
+     * cached otherwise. Cached results are shared, they must be
+     * read only. Queries must be a single statement. Ignored when
+     * the cache is disabled, see PQNB_OPT_RESULT_CACHE, for
+     * streamed queries and by sessions
+     */
+    PQNB_QUERY_CACHE = 1 << 3,
+    /*
+     * attached to the request of the same query and params queued
+     * or in flight, if any, instead of being submitted. Its result,
+     * error or timeout is passed to every attached callback in the
+     * order they were submitted, identical queries submitted after
+     * that start a new request. The result is shared, it must be
+     * read only, and so must be the query. Queries must be a single
+     * statement. Ignored for streamed queries and by sessions
+     */
+    PQNB_QUERY_SINGLE_FLIGHT = 1 << 4,
+};
+/*
+ * extended query, zeroed fields keep the defaults
+ */
+struct PQNB_query
+{
+    /*
+     * the sql query
+     */
+    const char *query;
+    /*
+     * PQsendQueryParams arguments, see PQNB_pool_query_params
+     */
+    const Oid *param_types;
+    const char *const *param_values;
+    const int *param_lengths;
+    const int *param_formats;
+    int num_params;
+    int result_format;
+    /*
+     * PQNB_query_flag bits
+     */
+    uint32_t flags;
+    /*
+     * rows per batch when streaming, needs libpq 17 chunked
+     * mode, rows are passed one by one otherwise
+     */
+    uint32_t stream_rows;
+    /*
+     * deadline in milliseconds from now, 0 uses the pool query
+     * timeout. A running query past it is cancelled
+     */
+    uint32_t timeout_ms;
+    /*
+     * priority / tenant class, below PQNB_MAX_QUERY_CLASSES.
+     * See PQNB_OPT_CLASS_WEIGHT
+     */
+    uint8_t query_class;
+    /*
+     * NOTIFY channel the PQNB_QUERY_CACHE result belongs to, see
+     * PQNB_pool_cache_invalidate. NULL if none
+     */
+    const char *cache_channel;
+};
+/**
+ * the query struct is copied, the query and params aren't
+ * unless PQNB_QUERY_COPY is set.
+ * returns like PQNB_pool_query
+ */
+int
+PQNB_pool_query_ex(struct PQNB_pool *pool, const struct PQNB_query *query,
+                   PQNB_query_cb query_cb,
+                   const void *user_data);
+/**
+ * thread-safe PQNB_pool_query_ex, the query runs on the next
+ * PQNB_pool_run and the callback is called from its thread.
+ * Queueing errors are passed to the callback.
+ * returns 0 on success, -1 on error
+ */
+int
+PQNB_pool_query_mt(struct PQNB_pool *pool, const struct PQNB_query *query,
+                   PQNB_query_cb query_cb,
+                   const void *user_data);
+/*
+ * drops the cached results of the channel, every cached
+ * result if NULL
+ */
+void
+PQNB_pool_cache_invalidate(struct PQNB_pool *pool, const char *channel);
+/*
+ * pools run by their own thread each, pinned to a core
+ */
+struct PQNB_pool_group;
+/**
+ * num_connections per shard.
+ * returns NULL on allocation errors / configuration problems
+ */
+struct PQNB_pool_group *
+PQNB_group_init(const char *conninfo, uint16_t num_shards,
+                uint16_t num_connections);
+/*
+ * stops the threads and deallocates everything
+ */
+void
+PQNB_group_free(struct PQNB_pool_group *group);
+/**
+ * sets the option on every shard, call it before PQNB_group_start.
+ * returns 0 on success, -1 on unknown option / invalid value
+ */
+int
+PQNB_group_set_option(struct PQNB_pool_group *group,
+                      enum PQNB_pool_option_type type,
+                      const union PQNB_pool_option *option);
+/**
+ * returns 0 on success, -1 on error
+ */
+int
+PQNB_group_start(struct PQNB_pool_group *group);
+/**
+ * safe from any thread. Shard threads, callbacks included, query
+ * their own shard, other threads are spread over the shards.
+ * Callbacks are called from the shard threads, requests queued on
+ * a busy shard may move to an idle one.
+ * returns like PQNB_pool_query_ex from shard threads,
+ * like PQNB_pool_query_mt otherwise
+ */
+int
+PQNB_group_query(struct PQNB_pool_group *group,
+                 const struct PQNB_query *query,
+                 PQNB_query_cb query_cb,
+                 const void *user_data);
+/*
+ * per query class counters
+ */
+struct PQNB_class_stats
+{
+    /*
+     * requests waiting for a connection
+     */
+    uint32_t queued;
+    /*
+     * requests sent to a connection
+     */
+    uint64_t dispatched;
+    /*
+     * requests timed out while waiting
+     */
+    uint64_t expired;
+    /*
+     * time waited by the dispatched requests, in nanoseconds
+     */
+    uint64_t wait_total_ns;
+    uint64_t wait_max_ns;
+};
+/**
+ * returns 0 on success, -1 on unknown class
+ */
+int
+PQNB_pool_get_class_stats(struct PQNB_pool *pool, uint8_t query_class,
+                          struct PQNB_class_stats *stats);
+/*
+ * a connection in COPY mode, valid until the query
+ * callback gets the COPY command final result
+ */
+struct PQNB_copy;
+/*
+ * copy callback events
+ */
+enum PQNB_copy_event
+{
+    /*
+     * COPY FROM STDIN: PQNB_copy_put may be called
+     */
+    PQNB_COPY_WRITABLE = 0,
+    /*
+     * COPY TO STDOUT: data / len is a chunk of rows, freed
+     * after the callback returns
+     */
+    PQNB_COPY_DATA,
+};
+typedef void (*PQNB_copy_cb)(struct PQNB_copy *copy,
+                             enum PQNB_copy_event event,
+                             const char *data,
+                             int len,
+                             void *user_data);
+/**
+ * runs a COPY FROM STDIN / TO STDOUT query, copy_cb is called for
+ * the data transfer and query_cb for the final result, errors
+ * and timeouts.
+ * returns like PQNB_pool_query
+ */
+int
+PQNB_pool_copy(struct PQNB_pool *pool, const char *query,
+               PQNB_copy_cb copy_cb,
+               PQNB_query_cb query_cb,
+               const void *user_data);
+/**
+ * queues COPY FROM STDIN data.
+ * returns 0 on success, 1 if it was queued but the socket is full,
+ * wait for PQNB_COPY_WRITABLE before putting more, -1 on error
+ */
+int
+PQNB_copy_put(struct PQNB_copy *copy, const char *data, int len);
+/**
+ * ends COPY FROM STDIN, a non NULL error_msg aborts it.
+ * returns 0 on success, -1 on error
+ */
+int
+PQNB_copy_end(struct PQNB_copy *copy, const char *error_msg);
+/*
+ * queries pinned to one connection, for transactions
+ */
+struct PQNB_session;
+/*
+ * session flags
+ */
+enum PQNB_session_flag
+{
+    /*
+     * BEGIN is sent ahead of the first query, PQNB_session_end
+     * sends COMMIT or ROLLBACK
+     */
+    PQNB_SESSION_TRANSACTION = 1 << 0,
+};
+/**
+ * waits for an idle connection of the primary like a query,
+ * within timeout_ms (0 uses the pool query timeout). Queries
+ * may be submitted right away, they are sent pipelined once
+ * the connection is acquired. Failing to acquire it fails them.
+ * returns NULL on errors, the queue being full or the
+ * database unavailable
+ */
+struct PQNB_session *
+PQNB_pool_session(struct PQNB_pool *pool, uint32_t flags,
+                  uint32_t timeout_ms);
+/**
+ * sends the query on the session connection, pipelined after the
+ * previous ones. query_class and PQNB_QUERY_READ_ONLY are ignored.
+ * A timeout or a lost connection fails the session, queries are
+ * refused from then on and a transaction is rolled back.
+ * returns 0 on success, -1 on error / failed or ended session
+ */
+int
+PQNB_session_query(struct PQNB_session *session,
+                   const struct PQNB_query *query,
+                   PQNB_query_cb query_cb,
+                   const void *user_data);
+/**
+ * ends the session, the connection goes back to the pool once
+ * its queries complete and the session is freed. Transactions
+ * send COMMIT, or ROLLBACK if commit is false or the session
+ * failed, its result goes to query_cb if not NULL.
+ * returns 0 on success, -1 on error, the session is ended anyway
+ */
+int
+PQNB_session_end(struct PQNB_session *session, bool commit,
+                 PQNB_query_cb query_cb,
+                 const void *user_data);
+/*
+ * payload is empty if the NOTIFY had none. channel and
+ * payload are freed once it returns
+ */
+typedef void (*PQNB_notify_cb)(struct PQNB_pool *pool,
+                               const char *channel,
+                               const char *payload,
+                               int be_pid,
+                               void *user_data);
+/**
+ * subscribes to the channel, notifications are passed to notify_cb
+ * from PQNB_pool_run. Channels are listened on a connection of the
+ * primary taken from the pool while any is subscribed, listened
+ * again on another one if it is lost, notifications sent meanwhile
+ * are missed. Results cached with the channel as cache_channel are
+ * invalidated first, notify_cb may be NULL to only invalidate them.
+ * Subscribing again replaces the callback. Channel names are
+ * identifiers of up to 63 bytes, case sensitive.
+ * returns 0 on success, -1 on error
+ */
+int
+PQNB_pool_listen(struct PQNB_pool *pool, const char *channel,
+                 PQNB_notify_cb notify_cb,
+                 const void *user_data);
+/**
+ * unsubscribes from the channel, the connection goes back to the
+ * pool with the last one.
+ * returns 0 on success, -1 if it wasn't subscribed
+ */
+int
+PQNB_pool_unlisten(struct PQNB_pool *pool, const char *channel);
+/*
+ * C types binary results are decoded to
+ */
+enum PQNB_field_type
+{
+    /*
+     * int16_t from int2
+     */
+    PQNB_FIELD_INT16 = 0,
+    /*
+     * int32_t from int2 / int4
+     */
+    PQNB_FIELD_INT32,
+    /*
+     * int64_t from int2 / int4 / int8
+     */
+    PQNB_FIELD_INT64,
+    /*
+     * float from float4
+     */
+    PQNB_FIELD_FLOAT,
+    /*
+     * double from float4 / float8
+     */
+    PQNB_FIELD_DOUBLE,
+    /*
+     * bool from bool
+     */
+    PQNB_FIELD_BOOL,
+    /*
+     * int64_t microseconds since the unix epoch
+     * from timestamp / timestamptz
+     */
+    PQNB_FIELD_TIMESTAMP,
+    /*
+     * uint8_t[16] from uuid
+     */
+    PQNB_FIELD_UUID,
+    /*
+     * struct PQNB_bytes from bytea / text / varchar / bpchar
+     */
+    PQNB_FIELD_BYTES,
+};
+/*
+ * points into the PGresult, valid until it is cleared.
+ * Not nul terminated
+ */
+struct PQNB_bytes
+{
+    const char *data;
+    size_t len;
+};
+/*
+ * NULL values are errors
+ */
+#define PQNB_NOT_NULL (-1)
+/*
+ * result column decoded into a row struct member
+ */
+struct PQNB_field
+{
+    int column;
+    /*
+     * column type OID, checked against the result
+     */
+    Oid type;
+    enum PQNB_field_type c_type;
+    /*
+     * offsetof the member
+     */
+    size_t offset;
+    /*
+     * offsetof a bool set for NULL values, the member is then
+     * zeroed. PQNB_NOT_NULL if the column can't be NULL
+     */
+    ptrdiff_t null_offset;
+};
+/*
+ * compiled row layout
+ */
+struct PQNB_row_layout;
+/*
+ * row_size is the sizeof the row struct.
+ * NULL on unsupported type / C type pairs or allocation errors
+ */
+struct PQNB_row_layout *
+PQNB_row_layout_init(const struct PQNB_field *fields, size_t num_fields,
+                     size_t row_size);
+
+void
+PQNB_row_layout_free(struct PQNB_row_layout *layout);
+/*
+ * decodes up to max_rows rows of a binary format result (result_format
+ * 1) into the rows array, no text conversion nor allocation involved.
+ * returns the number of rows, -1 if the result doesn't match the
+ * layout or has an unexpected NULL
+ */
+int
+PQNB_result_decode(const struct PQNB_row_layout *layout,
+                   const PGresult *result, void *rows, int max_rows);
 
 #endif /* END PQNB_H */
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include "pqnb.h"
+#include "fake_server.h"
+
+#include <libpq-fe.h>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_SEC 2
+#define BENCH_CONNECT_SEC 5
+
+enum bench_mode
+{
+  /*
+   * keeps concurrency queries in flight
+   */
+  BENCH_CLOSED = 0,
+  /*
+   * submits rate queries per second whatever the latency
+   */
+  BENCH_OPEN
+};
+
+struct bench_scenario
+{
+  const char *name;
+  enum bench_mode mode;
+  uint16_t connections;
+  uint16_t pipeline_depth;
+  uint32_t concurrency;
+  uint32_t rate;
+  uint32_t rows;
+  uint32_t row_size;
+  /*
+   * fake server only
+   */
+  uint32_t latency_us;
+};
+
+static const struct bench_scenario bench_scenarios[] = {
+  { "closed_c1_conn1", BENCH_CLOSED, 1, 1, 1, 0, 1, 16, 100 },
+  { "closed_c64_conn8", BENCH_CLOSED, 8, 1, 64, 0, 1, 16, 100 },
+  { "closed_c256_conn32", BENCH_CLOSED, 32, 1, 256, 0, 1, 16, 100 },
+  { "closed_c256_conn8_pipe8", BENCH_CLOSED, 8, 8, 256, 0, 1, 16, 100 },
+  { "closed_c64_conn8_rows100", BENCH_CLOSED, 8, 1, 64, 0, 100, 100, 100 },
+  { "closed_c64_conn8_rows1000", BENCH_CLOSED, 8, 1, 64, 0, 1000, 1000,
+    100 },
+  { "open_r10000_conn16", BENCH_OPEN, 16, 1, 0, 10000, 1, 16, 100 },
+  { "open_r50000_conn16_pipe4", BENCH_OPEN, 16, 4, 0, 50000, 1, 16, 100 },
+};
+
+struct bench_counter
+{
+  uint64_t in_flight;
+};
+
+static uint64_t
+bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t
+bench_cpu_ns(void)
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_THREAD, &usage);
+  return ((uint64_t) usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+         * 1000000000ULL
+         + ((uint64_t) usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)
+         * 1000ULL;
+}
+
+/*
+ * syscalls of the bench thread, counted by wrapping the libc
+ * calls the pool and libpq make. The fake server threads
+ * aren't counted
+ */
+static _Thread_local bool bench_counting;
+static uint64_t bench_syscalls;
+
+#define BENCH_WRAP(type, name, params, args)                    \
+type                                                            \
+name params                                                     \
+{                                                               \
+  static type (*real) params;                                   \
+  if (NULL == real)                                             \
+    real = (type (*) params) dlsym(RTLD_NEXT, #name);           \
+  if (bench_counting)                                           \
+    bench_syscalls++;                                           \
+  return real args;                                             \
+}
+
+BENCH_WRAP(ssize_t, read, (int fd, void *buf, size_t len), (fd, buf, len))
+BENCH_WRAP(ssize_t, write, (int fd, const void *buf, size_t len),
+           (fd, buf, len))
+BENCH_WRAP(ssize_t, recv, (int fd, void *buf, size_t len, int flags),
+           (fd, buf, len, flags))
+BENCH_WRAP(ssize_t, send, (int fd, const void *buf, size_t len, int flags),
+           (fd, buf, len, flags))
+BENCH_WRAP(int, poll, (struct pollfd *fds, nfds_t nfds, int timeout),
+           (fds, nfds, timeout))
+BENCH_WRAP(int, epoll_wait,
+           (int fd, struct epoll_event *events, int max, int timeout),
+           (fd, events, max, timeout))
+BENCH_WRAP(int, epoll_ctl,
+           (int fd, int op, int target, struct epoll_event *event),
+           (fd, op, target, event))
+BENCH_WRAP(int, timerfd_settime,
+           (int fd, int flags, const struct itimerspec *value,
+            struct itimerspec *old),
+           (fd, flags, value, old))
+
+static void
+bench_query_cb(PGresult *res, void *user_data, char *error_msg,
+               bool timeout)
+{
+  struct bench_counter *counter = user_data;
+
+  (void) res;
+  (void) error_msg;
+  (void) timeout;
+  counter->in_flight--;
+}
+
+static const struct PQNB_pool_stats *
+bench_stats(struct PQNB_pool *pool)
+{
+  return &PQNB_pool_get_info(pool, PQNB_INFO_STATS)->stats;
+}
+
+static double
+bench_us(const struct PQNB_histogram *histogram, double percentile)
+{
+  return PQNB_histogram_percentile(histogram, percentile) / 1000.0;
+}
+
+/*
+ * runs one scenario, prints its results as a JSON line.
+ * returns 0 on success, -1 on error
+ */
+static int
+bench_run(const struct bench_scenario *scenario, const char *conninfo,
+          uint32_t seconds)
+{
+  struct fake_server_config config = {
+    .latency_us = scenario->latency_us,
+    .rows = scenario->rows,
+    .row_size = scenario->row_size,
+  };
+  struct fake_server *server = NULL;
+  struct PQNB_pool *pool = NULL;
+  const struct PQNB_pool_stats *stats;
+  union PQNB_pool_option option;
+  struct bench_counter counter = { 0 };
+  struct pollfd pfd = { .events = POLLIN };
+  uint64_t start, end, now, cpu, syscalls, submitted = 0;
+  char query[128];
+  int res = -1;
+
+  if (NULL == conninfo)
+    {
+      server = fake_server_start(&config);
+      if (NULL == server)
+        return -1;
+      conninfo = fake_server_conninfo(server);
+    }
+  /* the same shape from a real server */
+  snprintf(query, sizeof(query),
+           "SELECT repeat('x', %" PRIu32 ") FROM generate_series(1, %"
+           PRIu32 ")", scenario->row_size, scenario->rows);
+
+  pool = PQNB_pool_init(conninfo, scenario->connections);
+  if (NULL == pool)
+    goto cleanup;
+  option.pipeline_depth = scenario->pipeline_depth;
+  if (-1 == PQNB_pool_set_option(pool, PQNB_OPT_PIPELINE_DEPTH, &option))
+    goto cleanup;
+  /* the pool epoll fd is readable when it has events */
+  pfd.fd = PQNB_pool_get_info(pool, PQNB_INFO_EPOLL_FD)->epoll_fd;
+
+  /* waiting for every connection */
+  end = bench_now() + BENCH_CONNECT_SEC * 1000000000ULL;
+  for (;;)
+    {
+      stats = bench_stats(pool);
+      if (stats->idle == scenario->connections)
+        break;
+      if (bench_now() >= end)
+        {
+          fprintf(stderr, "%s: could not connect\n", scenario->name);
+          goto cleanup;
+        }
+      poll(&pfd, 1, 10);
+      PQNB_pool_run(pool);
+    }
+
+  cpu = bench_cpu_ns();
+  syscalls = bench_syscalls;
+  bench_counting = true;
+  start = bench_now();
+  end = start + seconds * 1000000000ULL;
+  for (now = start; now < end; now = bench_now())
+    {
+      if (BENCH_CLOSED == scenario->mode)
+        {
+          while (counter.in_flight < scenario->concurrency
+                 && 0 == PQNB_pool_query(pool, query, bench_query_cb,
+                                         &counter))
+            counter.in_flight++;
+        }
+      else
+        {
+          /* catching up with the arrivals due by now */
+          const uint64_t due = (now - start) * scenario->rate
+                               / 1000000000ULL;
+          for (; submitted < due; submitted++)
+            if (0 == PQNB_pool_query(pool, query, bench_query_cb,
+                                     &counter))
+              counter.in_flight++;
+        }
+      poll(&pfd, 1, BENCH_OPEN == scenario->mode ? 1 : 100);
+      if (-1 == PQNB_pool_run(pool))
+        goto cleanup;
+    }
+  bench_counting = false;
+  cpu = bench_cpu_ns() - cpu;
+  syscalls = bench_syscalls - syscalls;
+
+  stats = bench_stats(pool);
+  printf("{\"scenario\": \"%s\", \"mode\": \"%s\", \"connections\": %u, "
+         "\"pipeline_depth\": %u, \"concurrency\": %" PRIu32 ", "
+         "\"rate\": %" PRIu32 ", \"rows\": %" PRIu32 ", "
+         "\"row_size\": %" PRIu32 ", \"seconds\": %" PRIu32 ", "
+         "\"queries\": %" PRIu64 ", \"errors\": %" PRIu64 ", "
+         "\"timeouts\": %" PRIu64 ", \"rejected\": %" PRIu64 ", "
+         "\"qps\": %.0f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+         "\"p999_us\": %.1f, \"max_us\": %.1f, "
+         "\"cpu_us_per_query\": %.2f, \"syscalls_per_query\": %.2f}\n",
+         scenario->name,
+         BENCH_CLOSED == scenario->mode ? "closed" : "open",
+         scenario->connections, scenario->pipeline_depth,
+         scenario->concurrency, scenario->rate, scenario->rows,
+         scenario->row_size, seconds,
+         stats->completed, stats->errors, stats->timeouts, stats->rejected,
+         stats->completed / ((now - start) / 1e9),
+         bench_us(&stats->total, 50.0),
+         bench_us(&stats->total, 99.0),
+         bench_us(&stats->total, 99.9),
+         stats->total.max_ns / 1000.0,
+         0 < stats->completed ? cpu / 1000.0 / stats->completed : 0.0,
+         0 < stats->completed ? (double) syscalls / stats->completed
+                              : 0.0);
+  fflush(stdout);
+  res = 0;
+cleanup:
+  bench_counting = false;
+  if (NULL != pool)
+    PQNB_pool_free(pool);
+  if (NULL != server)
+    fake_server_stop(server);
+  return res;
+}
+
+/*
+ * bench [seconds per scenario] [conninfo], runs every scenario
+ * against the fake server unless a connection string is given.
+ * Latencies go from submission to completion, CPU and syscalls
+ * are the ones of the pool thread
+ */
+int
+main(int argc, char **argv)
+{
+  const uint32_t seconds = 1 < argc ? (uint32_t) atoi(argv[1])
+                                    : BENCH_DEFAULT_SEC;
+  const char *conninfo = 2 < argc && '\0' != argv[2][0] ? argv[2] : NULL;
+  int res = 0;
+
+  assert(0 < seconds);
+  for (size_t i = 0;
+       i < sizeof(bench_scenarios) / sizeof(bench_scenarios[0]); i++)
+    if (-1 == bench_run(&bench_scenarios[i], conninfo, seconds))
+      res = 1;
+  return res;
+}
@@ -0,0 +1,1143 @@
+#define _GNU_SOURCE
+#include "fake_server.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FAKE_SERVER_PORT 5432
+#define FAKE_SSL_REQUEST 80877103
+#define FAKE_GSS_REQUEST 80877104
+#define FAKE_CANCEL_REQUEST 80877102
+#define FAKE_TEXT_OID 25
+/*
+ * pending output is sent once it reaches this
+ */
+#define FAKE_FLUSH_SIZE 65536
+#define FAKE_NSEC_PER_MSEC 1000000ULL
+
+enum fake_kind
+{
+  FAKE_EMPTY = 0,
+  FAKE_ROWS,
+  FAKE_COMMAND,
+  FAKE_COPY_IN,
+  FAKE_COPY_OUT
+};
+
+enum fake_fault
+{
+  FAKE_NONE = 0,
+  FAKE_ERROR,
+  FAKE_DROP,
+  FAKE_STALL
+};
+
+/*
+ * prepared statement, the unnamed one included
+ */
+struct fake_stmt
+{
+  struct fake_stmt *next;
+  char *name;
+  char *query;
+  int16_t num_params;
+};
+
+struct fake_client
+{
+  struct fake_client *next;
+  struct fake_server *server;
+  pthread_t thread;
+  int fd;
+  /*
+   * BackendKeyData, matched by cancel requests
+   */
+  int32_t pid;
+  int32_t key;
+  atomic_bool cancelled;
+  atomic_bool done;
+  /*
+   * buffered input, unread bytes are in [in_start, in_end)
+   */
+  char *in;
+  size_t in_start;
+  size_t in_end;
+  size_t in_size;
+  char *out;
+  size_t out_len;
+  size_t out_size;
+  /*
+   * offset of the message being written
+   */
+  size_t message;
+  struct fake_stmt *stmts;
+  /*
+   * unnamed portal, NULL if none was bound
+   */
+  char *portal;
+  int16_t portal_format;
+  /*
+   * ReadyForQuery transaction status
+   */
+  char status;
+  /*
+   * extended query failed, skipping messages up to the sync
+   */
+  bool failed;
+};
+
+struct fake_server
+{
+  struct fake_server_config config;
+  char dir[32];
+  char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+  char conninfo[128];
+  int listen_fd;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  struct fake_client *clients;
+  int32_t next_pid;
+  /*
+   * row_size bytes, the value of every column
+   */
+  char *value;
+  atomic_uint queries;
+  atomic_bool stopping;
+};
+
+static uint64_t
+fake_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static int
+fake_reserve(struct fake_client *client, size_t len)
+{
+  size_t size = 0 < client->out_size ? client->out_size : 4096;
+  char *out;
+
+  if (client->out_len + len <= client->out_size)
+    return 0;
+  while (size < client->out_len + len)
+    size *= 2;
+  out = realloc(client->out, size);
+  if (NULL == out)
+    return -1;
+  client->out = out;
+  client->out_size = size;
+  return 0;
+}
+
+static void
+fake_put(struct fake_client *client, const void *data, size_t len)
+{
+  if (-1 == fake_reserve(client, len))
+    abort();
+  memcpy(client->out + client->out_len, data, len);
+  client->out_len += len;
+}
+
+static void
+fake_put8(struct fake_client *client, char value)
+{
+  fake_put(client, &value, 1);
+}
+
+static void
+fake_put16(struct fake_client *client, int16_t value)
+{
+  const uint16_t net = htons((uint16_t) value);
+  fake_put(client, &net, sizeof(net));
+}
+
+static void
+fake_put32(struct fake_client *client, int32_t value)
+{
+  const uint32_t net = htonl((uint32_t) value);
+  fake_put(client, &net, sizeof(net));
+}
+
+static void
+fake_put_str(struct fake_client *client, const char *str)
+{
+  fake_put(client, str, strlen(str) + 1);
+}
+
+/*
+ * starts a message, its length is set by fake_end
+ */
+static void
+fake_begin(struct fake_client *client, char type)
+{
+  fake_put8(client, type);
+  client->message = client->out_len;
+  fake_put32(client, 0);
+}
+
+static void
+fake_end(struct fake_client *client)
+{
+  const uint32_t net = htonl((uint32_t) (client->out_len
+                                         - client->message));
+  memcpy(client->out + client->message, &net, sizeof(net));
+}
+
+static int
+fake_flush(struct fake_client *client)
+{
+  size_t sent = 0;
+
+  while (sent < client->out_len)
+    {
+      const ssize_t res = send(client->fd, client->out + sent,
+                               client->out_len - sent, MSG_NOSIGNAL);
+      if (-1 == res && EINTR == errno)
+        continue;
+      if (0 >= res)
+        return -1;
+      sent += (size_t) res;
+    }
+  client->out_len = 0;
+  return 0;
+}
+
+/*
+ * waits for len unread bytes, sending the pending output first
+ */
+static int
+fake_fill(struct fake_client *client, size_t len)
+{
+  while (client->in_end - client->in_start < len)
+    {
+      ssize_t res;
+
+      if (-1 == fake_flush(client))
+        return -1;
+      if (0 < client->in_start)
+        {
+          memmove(client->in, client->in + client->in_start,
+                  client->in_end - client->in_start);
+          client->in_end -= client->in_start;
+          client->in_start = 0;
+        }
+      if (client->in_size < len || client->in_size == client->in_end)
+        {
+          size_t size = 0 < client->in_size ? 2 * client->in_size : 8192;
+          char *in;
+          while (size < len)
+            size *= 2;
+          in = realloc(client->in, size);
+          if (NULL == in)
+            return -1;
+          client->in = in;
+          client->in_size = size;
+        }
+      res = recv(client->fd, client->in + client->in_end,
+                 client->in_size - client->in_end, 0);
+      if (-1 == res && EINTR == errno)
+        continue;
+      if (0 >= res)
+        return -1;
+      client->in_end += (size_t) res;
+    }
+  return 0;
+}
+
+static uint32_t
+fake_get32(const char *data)
+{
+  uint32_t net;
+
+  memcpy(&net, data, sizeof(net));
+  return ntohl(net);
+}
+
+static int16_t
+fake_get16(const char *data)
+{
+  uint16_t net;
+
+  memcpy(&net, data, sizeof(net));
+  return (int16_t) ntohs(net);
+}
+
+/*
+ * next nul terminated string of the body, NULL if truncated
+ */
+static const char *
+fake_get_str(const char **data, const char *end)
+{
+  const char *str = *data;
+  const char *nul = memchr(str, '\0', (size_t) (end - str));
+
+  if (NULL == nul)
+    return NULL;
+  *data = nul + 1;
+  return str;
+}
+
+/*
+ * next frontend message, the body is valid until the next read
+ */
+static int
+fake_read_message(struct fake_client *client, char *type,
+                  const char **body, size_t *len)
+{
+  uint32_t size;
+
+  if (-1 == fake_fill(client, 5))
+    return -1;
+  size = fake_get32(client->in + client->in_start + 1);
+  if (4 > size || (1 << 30) < size)
+    return -1;
+  if (-1 == fake_fill(client, 1 + size))
+    return -1;
+  *type = client->in[client->in_start];
+  *body = client->in + client->in_start + 5;
+  *len = size - 4;
+  client->in_start += 1 + size;
+  return 0;
+}
+
+static void
+fake_error(struct fake_client *client, const char *code,
+           const char *message)
+{
+  fake_begin(client, 'E');
+  fake_put8(client, 'S');
+  fake_put_str(client, "ERROR");
+  fake_put8(client, 'V');
+  fake_put_str(client, "ERROR");
+  fake_put8(client, 'C');
+  fake_put_str(client, code);
+  fake_put8(client, 'M');
+  fake_put_str(client, message);
+  fake_put8(client, '\0');
+  fake_end(client);
+  if ('T' == client->status)
+    client->status = 'E';
+}
+
+static void
+fake_ready(struct fake_client *client)
+{
+  fake_begin(client, 'Z');
+  fake_put8(client, client->status);
+  fake_end(client);
+}
+
+static void
+fake_row_description(struct fake_client *client, int16_t format)
+{
+  fake_begin(client, 'T');
+  fake_put16(client, 1);
+  fake_put_str(client, "value");
+  fake_put32(client, 0);
+  fake_put16(client, 0);
+  fake_put32(client, FAKE_TEXT_OID);
+  fake_put16(client, -1);
+  fake_put32(client, -1);
+  fake_put16(client, format);
+  fake_end(client);
+}
+
+static bool
+fake_starts(const char *query, const char *word)
+{
+  const size_t len = strlen(word);
+
+  return 0 == strncasecmp(query, word, len)
+    && !isalnum((unsigned char) query[len]);
+}
+
+static const char *
+fake_skip_spaces(const char *query)
+{
+  while (isspace((unsigned char) *query))
+    query++;
+  return query;
+}
+
+static enum fake_kind
+fake_kind(const char *query)
+{
+  query = fake_skip_spaces(query);
+  if ('\0' == *query || ';' == *query)
+    return FAKE_EMPTY;
+  if (fake_starts(query, "SELECT") || fake_starts(query, "VALUES")
+      || fake_starts(query, "WITH") || fake_starts(query, "SHOW")
+      || fake_starts(query, "TABLE"))
+    return FAKE_ROWS;
+  if (fake_starts(query, "COPY"))
+    return NULL != strcasestr(query, "STDIN") ? FAKE_COPY_IN
+                                              : FAKE_COPY_OUT;
+  return FAKE_COMMAND;
+}
+
+static bool
+fake_ends_transaction(const char *query)
+{
+  query = fake_skip_spaces(query);
+  return fake_starts(query, "COMMIT") || fake_starts(query, "END")
+    || fake_starts(query, "ROLLBACK") || fake_starts(query, "ABORT");
+}
+
+static enum fake_fault
+fake_fault(struct fake_client *client, const char *query)
+{
+  const struct fake_server_config *config = &client->server->config;
+  const unsigned n = atomic_fetch_add(&client->server->queries, 1) + 1;
+
+  if (NULL != strstr(query, "fake:error"))
+    return FAKE_ERROR;
+  if (NULL != strstr(query, "fake:drop"))
+    return FAKE_DROP;
+  if (NULL != strstr(query, "fake:stall"))
+    return FAKE_STALL;
+  if (0 < config->drop_every && 0 == n % config->drop_every)
+    return FAKE_DROP;
+  if (0 < config->stall_every && 0 == n % config->stall_every)
+    return FAKE_STALL;
+  if (0 < config->error_every && 0 == n % config->error_every)
+    return FAKE_ERROR;
+  return FAKE_NONE;
+}
+
+/*
+ * sleeps up to ns, returns 1 if cancelled, -1 if the client
+ * hung up or the server stops, 0 otherwise
+ */
+static int
+fake_wait(struct fake_client *client, uint64_t ns)
+{
+  const uint64_t start = fake_now();
+
+  for (;;)
+    {
+      struct pollfd pfd = { .fd = client->fd, .events = POLLRDHUP };
+      const uint64_t elapsed = fake_now() - start;
+      uint64_t slice;
+
+      if (atomic_load(&client->server->stopping))
+        return -1;
+      if (atomic_load(&client->cancelled))
+        return 1;
+      if (0 < poll(&pfd, 1, 0)
+          && 0 != (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)))
+        return -1;
+      if (elapsed >= ns)
+        return 0;
+      slice = ns - elapsed < FAKE_NSEC_PER_MSEC ? ns - elapsed
+                                                : FAKE_NSEC_PER_MSEC;
+      nanosleep(&(struct timespec) { .tv_nsec = (long) slice }, NULL);
+    }
+}
+
+/*
+ * command tag from the first word, transaction commands
+ * update the status
+ */
+static void
+fake_command(struct fake_client *client, const char *query)
+{
+  char tag[32];
+  size_t len = 0;
+
+  query = fake_skip_spaces(query);
+  while (len < sizeof(tag) - 8 && isalpha((unsigned char) query[len]))
+    {
+      tag[len] = (char) toupper((unsigned char) query[len]);
+      len++;
+    }
+  tag[len] = '\0';
+
+  if (0 == strcmp(tag, "BEGIN") || 0 == strcmp(tag, "START"))
+    client->status = 'T';
+  else if (0 == strcmp(tag, "COMMIT") || 0 == strcmp(tag, "END")
+           || 0 == strcmp(tag, "ROLLBACK") || 0 == strcmp(tag, "ABORT"))
+    {
+      /* failed transactions are rolled back on commit */
+      if ('E' == client->status)
+        strcpy(tag, "ROLLBACK");
+      client->status = 'I';
+    }
+  else if (0 == strcmp(tag, "INSERT"))
+    strcat(tag, " 0 1");
+  else if (0 == strcmp(tag, "UPDATE") || 0 == strcmp(tag, "DELETE"))
+    strcat(tag, " 1");
+
+  fake_begin(client, 'C');
+  fake_put_str(client, tag);
+  fake_end(client);
+}
+
+static int
+fake_rows(struct fake_client *client)
+{
+  const struct fake_server *server = client->server;
+  char tag[32];
+
+  for (uint32_t i = 0; i < server->config.rows; i++)
+    {
+      fake_begin(client, 'D');
+      fake_put16(client, 1);
+      fake_put32(client, (int32_t) server->config.row_size);
+      fake_put(client, server->value, server->config.row_size);
+      fake_end(client);
+      if (FAKE_FLUSH_SIZE <= client->out_len && -1 == fake_flush(client))
+        return -1;
+    }
+  snprintf(tag, sizeof(tag), "SELECT %" PRIu32, server->config.rows);
+  fake_begin(client, 'C');
+  fake_put_str(client, tag);
+  fake_end(client);
+  return 0;
+}
+
+static int
+fake_copy_in(struct fake_client *client)
+{
+  uint64_t count = 0;
+  const char *body;
+  size_t len;
+  char type;
+  char tag[32];
+
+  fake_begin(client, 'G');
+  fake_put8(client, 0);
+  fake_put16(client, 1);
+  fake_put16(client, 0);
+  fake_end(client);
+
+  for (;;)
+    {
+      if (-1 == fake_read_message(client, &type, &body, &len))
+        return -1;
+      if ('d' == type)
+        count++;
+      else if ('c' == type)
+        break;
+      else if ('f' == type)
+        {
+          fake_error(client, "57014", "COPY from stdin failed");
+          return 1;
+        }
+      else if ('X' == type)
+        return -1;
+    }
+  snprintf(tag, sizeof(tag), "COPY %" PRIu64, count);
+  fake_begin(client, 'C');
+  fake_put_str(client, tag);
+  fake_end(client);
+  return 0;
+}
+
+static int
+fake_copy_out(struct fake_client *client)
+{
+  const struct fake_server *server = client->server;
+  char tag[32];
+
+  fake_begin(client, 'H');
+  fake_put8(client, 0);
+  fake_put16(client, 1);
+  fake_put16(client, 0);
+  fake_end(client);
+  for (uint32_t i = 0; i < server->config.rows; i++)
+    {
+      fake_begin(client, 'd');
+      fake_put(client, server->value, server->config.row_size);
+      fake_put8(client, '\n');
+      fake_end(client);
+      if (FAKE_FLUSH_SIZE <= client->out_len && -1 == fake_flush(client))
+        return -1;
+    }
+  fake_begin(client, 'c');
+  fake_end(client);
+  snprintf(tag, sizeof(tag), "COPY %" PRIu32, server->config.rows);
+  fake_begin(client, 'C');
+  fake_put_str(client, tag);
+  fake_end(client);
+  return 0;
+}
+
+/*
+ * runs the query, the row description was already sent for
+ * extended queries. returns 0 on success, 1 if an error was
+ * sent, -1 to close the connection
+ */
+static int
+fake_execute(struct fake_client *client, const char *query,
+             int16_t format, bool simple)
+{
+  const struct fake_server_config *config = &client->server->config;
+  const enum fake_kind kind = fake_kind(query);
+  const enum fake_fault fault = fake_fault(client, query);
+  int res = 0;
+
+  atomic_store(&client->cancelled, false);
+  if (0 < config->latency_us)
+    {
+      if (-1 == fake_flush(client))
+        return -1;
+      res = fake_wait(client, config->latency_us * 1000ULL);
+    }
+  if (0 == res && FAKE_DROP == fault)
+    {
+      fake_flush(client);
+      return -1;
+    }
+  if (0 == res && FAKE_STALL == fault)
+    {
+      if (-1 == fake_flush(client))
+        return -1;
+      res = fake_wait(client, 0 < config->stall_ms
+                              ? config->stall_ms * FAKE_NSEC_PER_MSEC
+                              : UINT64_MAX);
+    }
+  if (-1 == res)
+    return -1;
+  if (1 == res)
+    {
+      fake_error(client, "57014",
+                 "canceling statement due to user request");
+      return 1;
+    }
+  if (FAKE_ERROR == fault)
+    {
+      fake_error(client, "XX000", "injected error");
+      return 1;
+    }
+  if ('E' == client->status && !fake_ends_transaction(query))
+    {
+      fake_error(client, "25P02", "current transaction is aborted, "
+                 "commands ignored until end of transaction block");
+      return 1;
+    }
+
+  switch (kind)
+    {
+    case FAKE_EMPTY:
+      fake_begin(client, 'I');
+      fake_end(client);
+      return 0;
+    case FAKE_ROWS:
+      if (simple)
+        fake_row_description(client, format);
+      return fake_rows(client);
+    case FAKE_COPY_IN:
+      return fake_copy_in(client);
+    case FAKE_COPY_OUT:
+      return fake_copy_out(client);
+    default:
+      fake_command(client, query);
+      return 0;
+    }
+}
+
+static struct fake_stmt *
+fake_find_stmt(struct fake_client *client, const char *name)
+{
+  struct fake_stmt *stmt;
+
+  for (stmt = client->stmts; NULL != stmt; stmt = stmt->next)
+    if (0 == strcmp(stmt->name, name))
+      return stmt;
+  return NULL;
+}
+
+static void
+fake_close_stmt(struct fake_client *client, const char *name)
+{
+  struct fake_stmt **link = &client->stmts;
+
+  while (NULL != *link)
+    {
+      struct fake_stmt *stmt = *link;
+      if (0 == strcmp(stmt->name, name))
+        {
+          *link = stmt->next;
+          free(stmt->name);
+          free(stmt->query);
+          free(stmt);
+          return;
+        }
+      link = &stmt->next;
+    }
+}
+
+static int
+fake_parse(struct fake_client *client, const char *body, size_t len)
+{
+  const char *end = body + len;
+  const char *name = fake_get_str(&body, end);
+  const char *query = NULL != name ? fake_get_str(&body, end) : NULL;
+  struct fake_stmt *stmt;
+
+  if (NULL == query || 2 > end - body)
+    return -1;
+  if ('\0' != name[0] && NULL != fake_find_stmt(client, name))
+    {
+      fake_error(client, "42P05", "prepared statement already exists");
+      return 1;
+    }
+  fake_close_stmt(client, name);
+  stmt = calloc(1, sizeof(*stmt));
+  if (NULL == stmt)
+    return -1;
+  stmt->name = strdup(name);
+  stmt->query = strdup(query);
+  stmt->num_params = fake_get16(body);
+  stmt->next = client->stmts;
+  client->stmts = stmt;
+  if (NULL == stmt->name || NULL == stmt->query)
+    return -1;
+  fake_begin(client, '1');
+  fake_end(client);
+  return 0;
+}
+
+static int
+fake_bind(struct fake_client *client, const char *body, size_t len)
+{
+  const char *end = body + len;
+  const char *portal = fake_get_str(&body, end);
+  const char *name = NULL != portal ? fake_get_str(&body, end) : NULL;
+  struct fake_stmt *stmt;
+  int16_t count;
+
+  if (NULL == name || 2 > end - body)
+    return -1;
+  stmt = fake_find_stmt(client, name);
+  if (NULL == stmt)
+    {
+      fake_error(client, "26000", "prepared statement does not exist");
+      return 1;
+    }
+  /* parameter formats */
+  count = fake_get16(body);
+  body += 2 + 2 * count;
+  if (2 > end - body)
+    return -1;
+  /* parameter values */
+  count = fake_get16(body);
+  body += 2;
+  for (int16_t i = 0; i < count; i++)
+    {
+      int32_t value_len;
+      if (4 > end - body)
+        return -1;
+      value_len = (int32_t) fake_get32(body);
+      body += 4 + (0 < value_len ? value_len : 0);
+    }
+  if (2 > end - body)
+    return -1;
+  /* result formats, the first one applies to every column */
+  count = fake_get16(body);
+  client->portal_format = 0 < count && 4 <= end - body
+                          ? fake_get16(body + 2) : 0;
+  free(client->portal);
+  client->portal = strdup(stmt->query);
+  if (NULL == client->portal)
+    return -1;
+  fake_begin(client, '2');
+  fake_end(client);
+  return 0;
+}
+
+static int
+fake_describe(struct fake_client *client, const char *body, size_t len)
+{
+  const char *end = body + len;
+  const char *name;
+  const char *query;
+  int16_t format = 0;
+  char kind;
+
+  if (1 > len)
+    return -1;
+  kind = *body++;
+  name = fake_get_str(&body, end);
+  if (NULL == name)
+    return -1;
+  if ('S' == kind)
+    {
+      struct fake_stmt *stmt = fake_find_stmt(client, name);
+      if (NULL == stmt)
+        {
+          fake_error(client, "26000", "prepared statement does not exist");
+          return 1;
+        }
+      fake_begin(client, 't');
+      fake_put16(client, stmt->num_params);
+      for (int16_t i = 0; i < stmt->num_params; i++)
+        fake_put32(client, FAKE_TEXT_OID);
+      fake_end(client);
+      query = stmt->query;
+    }
+  else
+    {
+      if (NULL == client->portal)
+        {
+          fake_error(client, "34000", "portal does not exist");
+          return 1;
+        }
+      query = client->portal;
+      format = client->portal_format;
+    }
+  if (FAKE_ROWS == fake_kind(query))
+    fake_row_description(client, format);
+  else
+    {
+      fake_begin(client, 'n');
+      fake_end(client);
+    }
+  return 0;
+}
+
+/*
+ * answers the startup packet, returns 0 once the client is
+ * ready for queries, -1 to close the connection
+ */
+static int
+fake_startup(struct fake_client *client)
+{
+  struct fake_server *server = client->server;
+
+  for (;;)
+    {
+      uint32_t len, code;
+
+      if (-1 == fake_fill(client, 8))
+        return -1;
+      len = fake_get32(client->in + client->in_start);
+      code = fake_get32(client->in + client->in_start + 4);
+      if (8 > len || 10000 < len || -1 == fake_fill(client, len))
+        return -1;
+
+      if (FAKE_SSL_REQUEST == code || FAKE_GSS_REQUEST == code)
+        {
+          client->in_start += len;
+          fake_put8(client, 'N');
+          continue;
+        }
+      if (FAKE_CANCEL_REQUEST == code && 16 == len)
+        {
+          const int32_t pid = (int32_t)
+            fake_get32(client->in + client->in_start + 8);
+          const int32_t key = (int32_t)
+            fake_get32(client->in + client->in_start + 12);
+          pthread_mutex_lock(&server->mutex);
+          for (struct fake_client *other = server->clients;
+               NULL != other; other = other->next)
+            if (other->pid == pid && other->key == key)
+              atomic_store(&other->cancelled, true);
+          pthread_mutex_unlock(&server->mutex);
+          return -1;
+        }
+      if (3 != code >> 16)
+        return -1;
+      client->in_start += len;
+      break;
+    }
+
+  fake_begin(client, 'R');
+  fake_put32(client, 0);
+  fake_end(client);
+  {
+    static const char *const params[][2] = {
+      { "server_version", "17.0" },
+      { "server_encoding", "UTF8" },
+      { "client_encoding", "UTF8" },
+      { "DateStyle", "ISO, MDY" },
+      { "integer_datetimes", "on" },
+      { "standard_conforming_strings", "on" },
+    };
+    for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++)
+      {
+        fake_begin(client, 'S');
+        fake_put_str(client, params[i][0]);
+        fake_put_str(client, params[i][1]);
+        fake_end(client);
+      }
+  }
+  fake_begin(client, 'K');
+  fake_put32(client, client->pid);
+  fake_put32(client, client->key);
+  fake_end(client);
+  fake_ready(client);
+  return 0;
+}
+
+static void *
+fake_client_run(void *arg)
+{
+  struct fake_client *client = arg;
+  const char *body;
+  size_t len;
+  char type;
+  int res = 0;
+
+  if (-1 == fake_startup(client))
+    goto done;
+
+  while (-1 != res
+         && -1 != fake_read_message(client, &type, &body, &len))
+    {
+      if ('X' == type)
+        break;
+      /* errors skip everything up to the sync */
+      if (client->failed && 'S' != type)
+        continue;
+      switch (type)
+        {
+        case 'Q':
+          if (NULL == memchr(body, '\0', len))
+            res = -1;
+          else if (-1 != (res = fake_execute(client, body, 0, true)))
+            fake_ready(client);
+          continue;
+        case 'P':
+          res = fake_parse(client, body, len);
+          break;
+        case 'B':
+          res = fake_bind(client, body, len);
+          break;
+        case 'D':
+          res = fake_describe(client, body, len);
+          break;
+        case 'E':
+          if (NULL == client->portal)
+            {
+              fake_error(client, "34000", "portal does not exist");
+              res = 1;
+            }
+          else
+            res = fake_execute(client, client->portal,
+                               client->portal_format, false);
+          break;
+        case 'C':
+          if (2 <= len && 'S' == body[0] && '\0' == body[len - 1])
+            fake_close_stmt(client, body + 1);
+          fake_begin(client, '3');
+          fake_end(client);
+          res = 0;
+          break;
+        case 'S':
+          client->failed = false;
+          fake_ready(client);
+          res = 0;
+          break;
+        case 'H':
+          res = fake_flush(client);
+          break;
+        default:
+          /* stray copy messages */
+          res = 0;
+          break;
+        }
+      if (1 == res)
+        client->failed = true;
+    }
+
+done:
+  /* the peer sees the hang up, the fd is closed once joined */
+  shutdown(client->fd, SHUT_RDWR);
+  atomic_store(&client->done, true);
+  return NULL;
+}
+
+static void
+fake_client_free(struct fake_client *client)
+{
+  while (NULL != client->stmts)
+    fake_close_stmt(client, client->stmts->name);
+  close(client->fd);
+  free(client->portal);
+  free(client->in);
+  free(client->out);
+  free(client);
+}
+
+/*
+ * joins the clients that are gone, the mutex must be held
+ */
+static void
+fake_reap(struct fake_server *server)
+{
+  struct fake_client **link = &server->clients;
+
+  while (NULL != *link)
+    {
+      struct fake_client *client = *link;
+      if (!atomic_load(&client->done))
+        {
+          link = &client->next;
+          continue;
+        }
+      *link = client->next;
+      pthread_join(client->thread, NULL);
+      fake_client_free(client);
+    }
+}
+
+static void *
+fake_server_run(void *arg)
+{
+  struct fake_server *server = arg;
+
+  for (;;)
+    {
+      struct fake_client *client;
+      const int fd = accept(server->listen_fd, NULL, NULL);
+
+      if (atomic_load(&server->stopping))
+        {
+          if (-1 != fd)
+            close(fd);
+          break;
+        }
+      if (-1 == fd)
+        continue;
+      client = calloc(1, sizeof(*client));
+      if (NULL == client)
+        {
+          close(fd);
+          continue;
+        }
+      client->server = server;
+      client->fd = fd;
+      client->status = 'I';
+      pthread_mutex_lock(&server->mutex);
+      fake_reap(server);
+      client->pid = ++server->next_pid;
+      client->key = (int32_t) ((uint32_t) client->pid * 2654435761U);
+      if (0 != pthread_create(&client->thread, NULL,
+                              fake_client_run, client))
+        {
+          pthread_mutex_unlock(&server->mutex);
+          fake_client_free(client);
+          continue;
+        }
+      client->next = server->clients;
+      server->clients = client;
+      pthread_mutex_unlock(&server->mutex);
+    }
+  return NULL;
+}
+
+struct fake_server *
+fake_server_start(const struct fake_server_config *config)
+{
+  struct fake_server *server = calloc(1, sizeof(*server));
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  if (NULL == server)
+    return NULL;
+  server->listen_fd = -1;
+  server->config = *config;
+  if (0 == server->config.rows)
+    server->config.rows = 1;
+  if (0 == server->config.row_size)
+    server->config.row_size = 16;
+  server->value = malloc(server->config.row_size);
+  if (NULL == server->value)
+    goto error;
+  memset(server->value, 'x', server->config.row_size);
+
+  strcpy(server->dir, "/tmp/pqnb-fake-XXXXXX");
+  if (NULL == mkdtemp(server->dir))
+    {
+      server->dir[0] = '\0';
+      goto error;
+    }
+  snprintf(server->path, sizeof(server->path), "%s/.s.PGSQL.%d",
+           server->dir, FAKE_SERVER_PORT);
+  snprintf(server->conninfo, sizeof(server->conninfo),
+           "host=%s port=%d dbname=fake user=fake",
+           server->dir, FAKE_SERVER_PORT);
+  strcpy(addr.sun_path, server->path);
+
+  server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (-1 == server->listen_fd
+      || -1 == bind(server->listen_fd, (struct sockaddr*) &addr,
+                    sizeof(addr))
+      || -1 == listen(server->listen_fd, 128))
+    goto error;
+  pthread_mutex_init(&server->mutex, NULL);
+  if (0 != pthread_create(&server->thread, NULL, fake_server_run, server))
+    {
+      pthread_mutex_destroy(&server->mutex);
+      goto error;
+    }
+  return server;
+error:
+  if (-1 != server->listen_fd)
+    close(server->listen_fd);
+  if ('\0' != server->dir[0])
+    {
+      unlink(server->path);
+      rmdir(server->dir);
+    }
+  free(server->value);
+  free(server);
+  return NULL;
+}
+
+void
+fake_server_stop(struct fake_server *server)
+{
+  struct fake_client *clients, *client;
+
+  atomic_store(&server->stopping, true);
+  /* wakes accept up */
+  shutdown(server->listen_fd, SHUT_RDWR);
+  pthread_join(server->thread, NULL);
+  close(server->listen_fd);
+
+  /* cancel requests look clients up with the mutex held */
+  pthread_mutex_lock(&server->mutex);
+  clients = server->clients;
+  server->clients = NULL;
+  pthread_mutex_unlock(&server->mutex);
+  for (client = clients; NULL != client; client = client->next)
+    shutdown(client->fd, SHUT_RDWR);
+  while (NULL != (client = clients))
+    {
+      clients = client->next;
+      pthread_join(client->thread, NULL);
+      fake_client_free(client);
+    }
+  pthread_mutex_destroy(&server->mutex);
+
+  unlink(server->path);
+  rmdir(server->dir);
+  free(server->value);
+  free(server);
+}
+
+const char *
+fake_server_conninfo(const struct fake_server *server)
+{
+  return server->conninfo;
+}
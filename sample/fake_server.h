@@ -0,0 +1,69 @@
+#ifndef FAKE_SERVER_H
+#define FAKE_SERVER_H
+
+#include <stdint.h>
+
+/*
+ * in-process stand-in for postgres, speaking enough of the v3
+ * protocol for the pool: startup without authentication, simple
+ * and extended queries, pipelines, cancel requests and COPY.
+ * Every client is served by its own thread, queries run one
+ * after the other as on a real backend.
+ *
+ * Queries starting with SELECT, VALUES, WITH, SHOW or TABLE return
+ * rows rows of a single text column of row_size bytes, anything
+ * else completes with its first word as the command tag.
+ * "COPY ... FROM STDIN" accepts any data, "COPY ... TO STDOUT"
+ * sends rows lines.
+ *
+ * Faults are injected every nth query, counted on the whole
+ * server, or by queries containing one of:
+ * - "fake:error", fails with an error
+ * - "fake:drop", closes the connection without answering
+ * - "fake:stall", answers after stall_ms, or once cancelled
+ */
+struct fake_server_config
+{
+  /*
+   * delay before answering each query, in microseconds
+   */
+  uint32_t latency_us;
+  /*
+   * result size, rows defaults to 1 and row_size to 16
+   */
+  uint32_t rows;
+  uint32_t row_size;
+  /*
+   * fault injection, 0 disables them
+   */
+  uint32_t error_every;
+  uint32_t drop_every;
+  uint32_t stall_every;
+  /*
+   * stall duration, 0 stalls until cancelled
+   */
+  uint32_t stall_ms;
+};
+
+struct fake_server;
+
+/*
+ * listens on a unix socket in a new temporary directory.
+ * NULL on error
+ */
+struct fake_server *
+fake_server_start(const struct fake_server_config *config);
+
+/*
+ * closes every connection and removes the socket
+ */
+void
+fake_server_stop(struct fake_server *server);
+
+/*
+ * libpq connection string for the server
+ */
+const char *
+fake_server_conninfo(const struct fake_server *server);
+
+#endif /* ~FAKE_SERVER_H */
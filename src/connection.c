@@ -1,17 +1,59 @@
 #include "internal.h"
 
 #include "connection.h"
+#include "session.h"
+#include "listen.h"
 
 #include <libpq-fe.h>
 
 #include <sys/epoll.h>
+#include <poll.h>
 #include <time.h>
 #include <stdlib.h>
 
+/*
+ * if the connection made it past connecting
+ */
+static bool
+PQNB_connection_up(struct PQNB_connection *conn)
+{
+  return CONN_CONNECTING != conn->action
+    && CONN_RECONNECTING != conn->action
+    && CONN_BACKOFF != conn->action;
+}
+
+static uint64_t
+PQNB_connection_random(struct PQNB_pool *pool)
+{
+  /* xorshift64 */
+  pool->rng ^= pool->rng << 13;
+  pool->rng ^= pool->rng >> 7;
+  pool->rng ^= pool->rng << 17;
+  return pool->rng;
+}
+
+/*
+ * exponential backoff with equal jitter, half of
+ * the delay is fixed and half random
+ */
+static uint64_t
+PQNB_connection_backoff(struct PQNB_connection *conn)
+{
+  struct PQNB_pool *pool = conn->pool;
+  uint64_t delay = pool->backoff_min;
+
+  for (uint32_t i = 0; i < conn->attempts && delay < pool->backoff_max; i++)
+    delay *= 2;
+  if (delay > pool->backoff_max)
+    delay = pool->backoff_max;
+  return delay / 2 + PQNB_connection_random(pool) % (delay / 2 + 1);
+}
+
 struct PQNB_connection *
-PQNB_connection_init(struct PQNB_pool *pool, const char *conninfo)
+PQNB_connection_init(struct PQNB_pool *pool, struct PQNB_host *host,
+                     const char *conninfo)
 {
-  struct timespec ts;
+  struct PQNB_connection *conn = NULL;
 
   PGconn *pg_conn = PQconnectStart(conninfo);
   if (NULL == pg_conn)
@@ -19,22 +61,31 @@ PQNB_connection_init(struct PQNB_pool *pool, const char *conninfo)
   if (CONNECTION_BAD == PQstatus(pg_conn))
     goto cleanup;
   PQsetnonblocking(pg_conn, 1);
-  if (-1 == clock_gettime(CLOCK_MONOTONIC, &ts))
-    goto cleanup;
-  struct PQNB_connection *conn = calloc(1, sizeof(*conn));
+  conn = calloc(1, sizeof(*conn));
   if (NULL == conn)
     goto cleanup;
+  conn->requests = PQNB_ring_buffer_init(PQNB_MAX_PIPELINE_DEPTH,
+                                         sizeof(struct PQNB_query_request));
+  if (NULL == conn->requests)
+    goto cleanup;
 
   conn->action = CONN_CONNECTING;
   conn->pool = pool;
+  conn->host = host;
   conn->pg_conn = pg_conn;
-  conn->last_activity = ts.tv_sec;
+  conn->timer.index = PQNB_TIMER_DISARMED;
+  conn->deadline = pool->now + pool->connect_timeout;
 
   PQNB_connecting_push(pool->connecting_head,
                        pool->connecting_tail, conn);
+  PQNB_conns_push(host->conns_head, host->conns_tail, conn);
+  host->num_connections++;
+  pool->num_connections++;
+  PQNB_connection_schedule(conn);
 
   return conn;
 cleanup:
+  free(conn);
   PQfinish(pg_conn);
   return NULL;
 }
@@ -42,7 +93,22 @@ cleanup:
 void
 PQNB_connection_free(struct PQNB_connection *conn)
 {
+  if (PQNB_connection_up(conn))
+    conn->host->connected--;
+  PQNB_conns_remove(conn->host->conns_head, conn->host->conns_tail, conn);
+  conn->host->num_connections--;
+  conn->pool->num_connections--;
+  PQNB_timer_disarm(conn->pool->conn_timers, &conn->timer);
   PQfinish(conn->pg_conn);
+  PQNB_ring_buffer_free(conn->requests);
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  if (NULL != conn->cancel_conn)
+    PQcancelFinish(conn->cancel_conn);
+#endif
+  if (NULL != conn->stmt_cache)
+    PQNB_stmt_cache_free(conn->stmt_cache);
+  if (NULL != conn->session)
+    conn->session->conn = NULL;
   free(conn);
 }
 
@@ -64,21 +130,26 @@ PQNB_connection_begin_polling(struct PQNB_connection *conn)
 static void
 PQNB_connection_unqueue(struct PQNB_connection *conn)
 {
-  if (CONN_IDLE == conn->action)
+  /* pipelined connections may be idle listed while querying */
+  if (PQNB_idle_listed(conn->host->idle_head, conn))
     {
-      PQNB_idle_remove(conn->pool->idle_head,
-                       conn->pool->idle_tail,
+      PQNB_idle_remove(conn->host->idle_head,
+                       conn->host->idle_tail,
                        conn);
     }
-  else if (CONN_QUERYING == conn->action
-           || CONN_FLUSHING == conn->action)
+  if (CONN_QUERYING == conn->action
+      || CONN_FLUSHING == conn->action
+      || CONN_CANCELLING == conn->action
+      || CONN_COPY_IN == conn->action
+      || CONN_COPY_OUT == conn->action)
     {
       PQNB_querying_remove(conn->pool->querying_head,
                            conn->pool->querying_tail,
                            conn);
     }
   else if (CONN_CONNECTING == conn->action
-           || CONN_RECONNECTING == conn->action)
+           || CONN_RECONNECTING == conn->action
+           || CONN_BACKOFF == conn->action)
     {
       PQNB_connecting_remove(conn->pool->connecting_head,
                              conn->pool->connecting_tail,
@@ -86,35 +157,345 @@ PQNB_connection_unqueue(struct PQNB_connection *conn)
     }
 }
 
-int
-PQNB_connection_reset(struct PQNB_connection *conn)
+/*
+ * moves the connection to the (re)connecting list,
+ * nothing can be assigned to it after this
+ */
+static void
+PQNB_connection_detach(struct PQNB_connection *conn)
 {
+  if (PQNB_connection_up(conn))
+    conn->host->connected--;
   PQNB_connection_unqueue(conn);
+  conn->pool->stats.resets++;
 
-  conn->action = CONN_RECONNECTING;
+  conn->action = CONN_BACKOFF;
+  conn->deadline = 0;
   conn->writable = 0;
   conn->readable = 0;
-  PQNB_connection_clear_data(conn);
+  conn->pipelined = 0;
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  if (NULL != conn->cancel_conn)
+    {
+      PQcancelFinish(conn->cancel_conn);
+      conn->cancel_conn = NULL;
+    }
+#endif
+  /* statements are lost with the session, preparing again on use */
+  if (NULL != conn->stmt_cache)
+    PQNB_stmt_cache_invalidate(conn->stmt_cache);
+  if (NULL != conn->session)
+    {
+      conn->session->conn = NULL;
+      conn->session = NULL;
+    }
 
   PQNB_connecting_push(conn->pool->connecting_head,
                        conn->pool->connecting_tail,
                        conn);
+}
 
-  if (0 == PQresetStart(conn->pg_conn))
-    return -1;
-  if (CONNECTION_BAD == PQstatus(conn->pg_conn))
-    return -1;
+/*
+ * reconnects once the backoff delay passes
+ */
+static int
+PQNB_connection_restart(struct PQNB_connection *conn)
+{
+  conn->action = CONN_BACKOFF;
+  conn->deadline = conn->pool->now + PQNB_connection_backoff(conn);
+  if (63 > conn->attempts)
+    conn->attempts++;
+  PQNB_connection_schedule(conn);
+  return 0;
+}
+
+/*
+ * starts reconnecting if few enough connections are,
+ * waits for another backoff step otherwise
+ */
+static void
+PQNB_connection_resume(struct PQNB_connection *conn)
+{
+  struct PQNB_pool *pool = conn->pool;
+  struct PQNB_connection *other;
+  uint16_t reconnecting = 0;
+
+  for (other = pool->connecting_head; NULL != other;
+       other = other->next_connecting)
+    if (CONN_CONNECTING == other->action
+        || CONN_RECONNECTING == other->action)
+      reconnecting++;
+  if (reconnecting >= pool->max_reconnects)
+    {
+      conn->deadline = pool->now + PQNB_connection_backoff(conn);
+      PQNB_connection_schedule(conn);
+      return;
+    }
+
+  conn->action = CONN_RECONNECTING;
+  conn->deadline = pool->now + pool->connect_timeout;
+  PQNB_connection_schedule(conn);
+  if (0 == PQresetStart(conn->pg_conn)
+      || CONNECTION_BAD == PQstatus(conn->pg_conn))
+    {
+      PQNB_connection_connect_failed(conn);
+      return;
+    }
   PQsetnonblocking(conn->pg_conn, 1);
+  if (-1 == PQNB_connection_begin_polling(conn))
+    PQNB_connection_connect_failed(conn);
+}
 
-  return PQNB_connection_begin_polling(conn);
+int
+PQNB_connection_reset(struct PQNB_connection *conn)
+{
+  PQNB_connection_detach(conn);
+  PQNB_connection_clear_data(conn);
+  return PQNB_connection_restart(conn);
+}
+
+int
+PQNB_connection_fail(struct PQNB_connection *conn,
+                     const char *error_msg, bool timeout)
+{
+  struct PQNB_session *session = conn->session;
+  struct PQNB_query_request *req;
+
+  /*
+   * detaching first, callbacks may query the pool again
+   */
+  PQNB_connection_detach(conn);
+  if (NULL != session)
+    PQNB_session_fail(session, error_msg, timeout);
+  while (NULL != (req = PQNB_connection_pop(conn, false)))
+    {
+      if (0 != req->cancelled)
+        continue;
+      if (timeout)
+        conn->pool->stats.timeouts++;
+      else
+        conn->pool->stats.errors++;
+      req->query_cb(NULL, req->user_data, (char*) error_msg, timeout);
+    }
+  return PQNB_connection_restart(conn);
+}
+
+/*
+ * notifies the in-flight requests past their deadline
+ */
+static void
+PQNB_connection_timeout(struct PQNB_connection *conn)
+{
+  struct PQNB_query_request *req;
+
+  for (size_t i = 0;
+       NULL != (req = PQNB_ring_buffer_at(conn->requests, i)); i++)
+    {
+      if (req->cancelled || conn->pool->now < req->timer.deadline)
+        continue;
+      req->cancelled = 1;
+      conn->pool->stats.timeouts++;
+      req->query_cb(NULL, req->user_data, NULL, true);
+      /* the transaction is aborted, the rest can't run */
+      if (NULL != conn->session && !conn->session->failed)
+        PQNB_session_fail(conn->session, "Session failed\n", false);
+    }
+  PQNB_connection_schedule(conn);
+}
+
+int
+PQNB_connection_cancel(struct PQNB_connection *conn)
+{
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  struct epoll_event event;
+
+  /*
+   * partially sent queries and copies are reset, so are pipelines,
+   * the cancel hits whichever query runs when it arrives
+   */
+  if (CONN_QUERYING != conn->action
+      || 1 < PQNB_ring_buffer_count(conn->requests))
+    return PQNB_connection_fail(conn, NULL, true);
+
+  conn->cancel_conn = PQcancelCreate(conn->pg_conn);
+  if (NULL == conn->cancel_conn)
+    return PQNB_connection_fail(conn, NULL, true);
+  if (0 == PQcancelStart(conn->cancel_conn))
+    goto cancel_error;
+
+  /*
+   * sharing the connection events, the cancel request
+   * is polled whenever any of both sockets is ready
+   */
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  event.data.ptr = conn;
+  if (-1 == epoll_ctl(conn->pool->epoll_fd, EPOLL_CTL_ADD,
+                      PQcancelSocket(conn->cancel_conn), &event))
+    goto cancel_error;
+
+  if (PQNB_idle_listed(conn->host->idle_head, conn))
+    PQNB_idle_remove(conn->host->idle_head, conn->host->idle_tail, conn);
+  conn->action = CONN_CANCELLING;
+  conn->pool->stats.cancels++;
+  /* reset if the query doesn't stop in time */
+  conn->deadline = conn->pool->now + conn->pool->query_timeout;
+
+  /*
+   * only the running query is cancelled,
+   * pipelined ones still have their own deadline
+   */
+  PQNB_connection_timeout(conn);
+  return 0;
+cancel_error:
+  PQcancelFinish(conn->cancel_conn);
+  conn->cancel_conn = NULL;
+  return PQNB_connection_fail(conn, NULL, true);
+#else
+  /*
+   * libpq < 17 doesn't support non blocking query
+   * cancellation so we reset the connection
+   */
+  return PQNB_connection_fail(conn, NULL, true);
+#endif
 }
 
 void
-PQNB_connection_cb_err(struct PQNB_connection *conn)
+PQNB_connection_cancel_poll(struct PQNB_connection *conn)
 {
-  conn->query_cb(NULL, conn->user_data,
-                 PQerrorMessage(conn->pg_conn),
-                 false);
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  if (NULL == conn->cancel_conn)
+    return;
+  switch (PQcancelPoll(conn->cancel_conn))
+    {
+    case PGRES_POLLING_READING:
+    case PGRES_POLLING_WRITING:
+      break;
+    default:
+      /*
+       * sent or failed, results are still awaited
+       * until the query completes or times out
+       */
+      PQcancelFinish(conn->cancel_conn);
+      conn->cancel_conn = NULL;
+      break;
+    }
+#else
+  (void) conn;
+#endif
+}
+
+/*
+ * closes an idle connection if the host has more than the minimum
+ */
+static void
+PQNB_connection_reap(struct PQNB_connection *conn)
+{
+  struct PQNB_pool *pool = conn->pool;
+  const int conn_fd = PQsocket(conn->pg_conn);
+
+  if (conn->host->num_connections <= pool->min_connections)
+    {
+      conn->deadline = 0;
+      PQNB_connection_schedule(conn);
+      return;
+    }
+  if (PQNB_idle_listed(conn->host->idle_head, conn))
+    PQNB_idle_remove(conn->host->idle_head, conn->host->idle_tail, conn);
+  if (-1 != conn_fd)
+    epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, conn_fd, NULL);
+  PQNB_connection_free(conn);
+}
+
+void
+PQNB_connection_expire(struct PQNB_connection *conn)
+{
+  struct PQNB_query_request *head;
+
+  /*
+   * idle, connecting, copy inactivity or cancel timeouts
+   */
+  if (0 != conn->deadline && conn->deadline <= conn->pool->now)
+    {
+      if (CONN_IDLE == conn->action)
+        {
+          PQNB_connection_reap(conn);
+          return;
+        }
+      if (CONN_BACKOFF == conn->action)
+        {
+          PQNB_connection_resume(conn);
+          return;
+        }
+      if ((CONN_CONNECTING == conn->action
+           || CONN_RECONNECTING == conn->action)
+          && UINT16_MAX > conn->host->failures)
+        conn->host->failures++;
+      PQNB_connection_fail(conn, NULL, true);
+      return;
+    }
+
+  head = PQNB_ring_buffer_tail(conn->requests);
+  if (NULL != head && 0 == head->cancelled
+      && head->timer.deadline <= conn->pool->now)
+    {
+      /*
+       * the running query timed out, partially sent
+       * ones can't be cancelled
+       */
+      if (CONN_QUERYING == conn->action)
+        PQNB_connection_cancel(conn);
+      else if (CONN_CANCELLING == conn->action)
+        PQNB_connection_timeout(conn);
+      else
+        PQNB_connection_fail(conn, NULL, true);
+      return;
+    }
+  PQNB_connection_timeout(conn);
+}
+
+void
+PQNB_connection_touch(struct PQNB_connection *conn)
+{
+  struct PQNB_query_request *head;
+
+  if (CONN_CONNECTING == conn->action
+      || CONN_RECONNECTING == conn->action)
+    conn->deadline = conn->pool->now + conn->pool->connect_timeout;
+  else if (NULL != (head = PQNB_ring_buffer_tail(conn->requests))
+           && NULL != head->copy_cb)
+    conn->deadline = conn->pool->now + conn->pool->query_timeout;
+  else
+    return;
+  PQNB_connection_schedule(conn);
+}
+
+void
+PQNB_connection_schedule(struct PQNB_connection *conn)
+{
+  struct PQNB_query_request *req;
+  uint64_t deadline = 0 == conn->deadline ? UINT64_MAX : conn->deadline;
+
+  for (size_t i = 0;
+       NULL != (req = PQNB_ring_buffer_at(conn->requests, i)); i++)
+    {
+      if (0 == req->cancelled && req->timer.deadline < deadline)
+        deadline = req->timer.deadline;
+    }
+  if (UINT64_MAX == deadline)
+    PQNB_timer_disarm(conn->pool->conn_timers, &conn->timer);
+  else
+    PQNB_timer_arm(conn->pool->conn_timers, &conn->timer, deadline);
+}
+
+bool
+PQNB_connection_cancelling(struct PQNB_connection *conn)
+{
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  return NULL != conn->cancel_conn;
+#else
+  (void) conn;
+  return false;
+#endif
 }
 
 int
@@ -124,7 +505,31 @@ PQNB_connection_read(struct PQNB_connection *conn)
 
   ret = PQconsumeInput(conn->pg_conn);
   conn->readable = 0;
-  return ret;
+#ifdef PQNB_TRACE
+  struct PQNB_query_request *req = PQNB_ring_buffer_tail(conn->requests);
+  if (1 == ret && NULL != req && 0 == req->first_read)
+    {
+      req->first_read = 1;
+      PQNB_trace(conn->pool, PQNB_TRACE_FIRST_READ, req);
+    }
+#endif
+  /* PQconsumeInput returns 0 on errors */
+  if (0 == ret)
+    return -1;
+  conn->unchecked = 1;
+  return 0;
+}
+
+bool
+PQNB_connection_pending(struct PQNB_connection *conn)
+{
+  struct pollfd pfd = { .fd = PQsocket(conn->pg_conn), .events = POLLIN };
+
+  /* nothing was read since the last check, epoll reports new data */
+  if (0 == conn->unchecked)
+    return false;
+  conn->unchecked = 0;
+  return 0 < poll(&pfd, 1, 0) && 0 != (POLLIN & pfd.revents);
 }
 
 int
@@ -134,40 +539,331 @@ PQNB_connection_write(struct PQNB_connection *conn)
 
   ret = PQflush(conn->pg_conn);
   conn->writable = 0;
+#ifdef PQNB_TRACE
+  /* everything sent so far left with this flush */
+  struct PQNB_query_request *req;
+  for (size_t i = 0; 0 == ret
+       && NULL != (req = PQNB_ring_buffer_at(conn->requests, i)); i++)
+    if (0 == req->flushed)
+      {
+        req->flushed = 1;
+        PQNB_trace(conn->pool, PQNB_TRACE_FLUSHED, req);
+      }
+#endif
   return ret;
 }
 
+bool
+PQNB_connection_has_slot(struct PQNB_connection *conn)
+{
+  if (NULL != conn->session)
+    return false;
+  if (CONN_IDLE == conn->action)
+    return true;
+  if (CONN_QUERYING != conn->action
+      && CONN_FLUSHING != conn->action)
+    return false;
+  return conn->pipelined
+    && PQNB_ring_buffer_count(conn->requests) 
+       < conn->pool->pipeline_depth;
+}
+
+/*
+ * cached statement for the request, NULL if the cache is
+ * disabled or on allocation errors, the query is then sent as is
+ */
+static struct PQNB_stmt *
+PQNB_connection_stmt(struct PQNB_connection *conn,
+                     struct PQNB_query_request *req,
+                     char *deallocate, size_t deallocate_len)
+{
+  struct PQNB_stmt *stmt;
+
+  deallocate[0] = '\0';
+  if (0 == conn->pool->statement_cache_size || 0 == conn->pipelined)
+    return NULL;
+  if (NULL == conn->stmt_cache)
+    {
+      conn->stmt_cache = PQNB_stmt_cache_init();
+      if (NULL == conn->stmt_cache)
+        return NULL;
+    }
+  stmt = PQNB_stmt_cache_get(conn->stmt_cache, req->query,
+                             req->num_params, req->param_types);
+  if (NULL == stmt)
+    stmt = PQNB_stmt_cache_add(conn->stmt_cache, req->query,
+                               req->num_params, req->param_types,
+                               conn->pool->statement_cache_size,
+                               deallocate, deallocate_len);
+  return stmt;
+}
+
+/*
+ * replicas out of rotation are left alone
+ */
+static bool
+PQNB_connection_serves(struct PQNB_connection *conn,
+                       struct PQNB_query_request *req)
+{
+  return conn->host == conn->pool->hosts
+    || (0 != req->read_only && !PQNB_host_down(conn->host));
+}
+
+bool
+PQNB_connection_accepts(struct PQNB_connection *conn,
+                        struct PQNB_query_request *req)
+{
+  if (NULL != conn->session || !PQNB_connection_serves(conn, req))
+    return false;
+  if (NULL != req->copy_cb || NULL != req->session)
+    return CONN_IDLE == conn->action;
+  return PQNB_connection_has_slot(conn);
+}
+
+bool
+PQNB_connection_batches(struct PQNB_connection *conn,
+                        struct PQNB_query_request *req)
+{
+  return NULL == req->copy_cb && NULL == req->session
+    && PQNB_connection_serves(conn, req) && conn->pipelined
+    && PQNB_ring_buffer_count(conn->requests) < conn->pool->batch_size;
+}
+
+struct PQNB_query_request *
+PQNB_connection_pop(struct PQNB_connection *conn, bool completed)
+{
+  struct PQNB_pool *pool = conn->pool;
+  struct PQNB_host *host = conn->host;
+  struct PQNB_query_request *req = PQNB_ring_buffer_pop(conn->requests);
+
+  if (NULL == req)
+    return NULL;
+  host->in_flight--;
+  /* every response was read, nothing can be left behind */
+  if (PQNB_ring_buffer_empty(conn->requests))
+    conn->unchecked = 0;
+  if (completed)
+    {
+      const uint64_t latency = pool->now - req->sent_at;
+      /* 1/8 gain, as TCP smoothed rtt */
+      if (0 == host->latency)
+        host->latency = latency;
+      else
+        host->latency = host->latency - host->latency / 8 + latency / 8;
+      if (0 == req->cancelled)
+        {
+          pool->stats.completed++;
+          PQNB_histogram_record(&pool->stats.total,
+                                pool->now - req->enqueued_at);
+          PQNB_trace(pool, PQNB_TRACE_COMPLETED, req);
+        }
+    }
+  /* the results don't need the query anymore */
+  PQNB_pool_release(pool, req);
+  return req;
+}
+
+void
+PQNB_connection_idle(struct PQNB_connection *conn)
+{
+  struct PQNB_pool *pool = conn->pool;
+
+  conn->action = CONN_IDLE;
+  /* pinned connections aren't reaped */
+  conn->deadline = 0 < pool->idle_timeout && NULL == conn->session
+                   ? pool->now + pool->idle_timeout : 0;
+}
+
+void
+PQNB_connection_connected(struct PQNB_connection *conn)
+{
+  conn->poll = CONN_POLL_OK;
+  conn->readable = 0;
+  conn->attempts = 0;
+  conn->host->failures = 0;
+  conn->host->connected++;
+  conn->pool->stats.connects++;
+  PQNB_connection_idle(conn);
+  PQNB_connection_schedule(conn);
+  PQNB_connecting_remove(conn->pool->connecting_head,
+                         conn->pool->connecting_tail, conn);
+  /* channels are listened again once the database is back */
+  PQNB_listen_acquire(conn->pool);
+}
+
 int
-PQNB_connection_query(struct PQNB_connection *conn,
-                      struct PQNB_query_request *req)
+PQNB_connection_connect_failed(struct PQNB_connection *conn)
+{
+  if (UINT16_MAX > conn->host->failures)
+    conn->host->failures++;
+  return PQNB_connection_reset(conn);
+}
+
+int
+PQNB_connection_send(struct PQNB_connection *conn,
+                     struct PQNB_query_request *req)
 {
-  int res;
+  const bool was_idle = CONN_IDLE == conn->action;
+  char deallocate[PQNB_STMT_NAME_LEN + sizeof("DEALLOCATE ")];
+  struct PQNB_stmt *stmt;
+  bool prepare;
+
+  /*
+   * the statement cache relies on pipelining prepare and execute,
+   * COPY isn't allowed in pipeline mode
+   */
+  if (NULL != req->copy_cb)
+    {
+      if (conn->pipelined && 1 == PQexitPipelineMode(conn->pg_conn))
+        conn->pipelined = 0;
+    }
+  else if (was_idle && 0 == conn->pipelined
+           && (1 < conn->pool->pipeline_depth
+               || 0 < conn->pool->statement_cache_size
+               || 1 < conn->pool->batch_size
+               || NULL != conn->session))
+    conn->pipelined = PQenterPipelineMode(conn->pg_conn);
+
+  stmt = PQNB_connection_stmt(conn, req, deallocate, sizeof(deallocate));
+  /*
+   * until the prepare succeeds the query is sent as is,
+   * a failed one would abort it along
+   */
+  if (NULL != stmt && stmt->preparing)
+    stmt = NULL;
+  prepare = NULL != stmt && !stmt->prepared;
+  req->deallocating = '\0' != deallocate[0];
+  req->preparing = prepare;
+  req->prepare_failed = 0;
+  req->stmt_id = prepare ? stmt->id : 0;
+
+  /*
+   * copies may take long, they time out on inactivity instead
+   */
+  if (NULL != req->copy_cb)
+    {
+      req->timer.deadline = UINT64_MAX;
+      conn->deadline = conn->pool->now + conn->pool->query_timeout;
+    }
+  else if (was_idle)
+    conn->deadline = 0;
+
+  req->sent_at = conn->pool->now;
 
-  conn->query_cb = req->query_cb;
-  conn->user_data = req->user_data;
+  /* copied, the request isn't written to past this point */
+  if (-1 == PQNB_ring_buffer_push(conn->requests, req))
+    {
+      PQNB_pool_release(conn->pool, req);
+      return -1;
+    }
+  conn->host->in_flight++;
+  PQNB_trace(conn->pool, PQNB_TRACE_DISPATCHED, req);
 
-  if (0 == PQsendQuery(conn->pg_conn, req->query))
+  /*
+   * synced on its own, its failure doesn't abort the query
+   */
+  if ('\0' != deallocate[0]
+      && (0 == PQsendQueryParams(conn->pg_conn, deallocate,
+                                 0, NULL, NULL, NULL, NULL, 0)
+          || 0 == PQpipelineSync(conn->pg_conn)))
     goto query_error;
-  res = PQNB_connection_write(conn);
-  if (0 == res)
-    conn->action = CONN_QUERYING;
-  else if (1 == res)
-    conn->action = CONN_FLUSHING;
-  else
+
+  if (prepare)
+    {
+      if (0 == PQsendPrepare(conn->pg_conn, stmt->name, req->query,
+                             req->num_params, req->param_types))
+        goto query_error;
+      stmt->preparing = true;
+    }
+
+  if (NULL != stmt)
+    {
+      if (0 == PQsendQueryPrepared(conn->pg_conn, stmt->name,
+                                   req->num_params,
+                                   req->param_values,
+                                   req->param_lengths,
+                                   req->param_formats,
+                                   req->result_format))
+        goto query_error;
+    }
+  /*
+   * PQsendQuery isn't allowed in pipeline mode on older libpq
+   */
+  else if (conn->pipelined || 0 < req->num_params
+           || 0 != req->result_format)
+    {
+      if (0 == PQsendQueryParams(conn->pg_conn, req->query,
+                                 req->num_params,
+                                 req->param_types,
+                                 req->param_values,
+                                 req->param_lengths,
+                                 req->param_formats,
+                                 req->result_format))
+        goto query_error;
+    }
+  else if (0 == PQsendQuery(conn->pg_conn, req->query))
     goto query_error;
-  PQNB_querying_push(conn->pool->querying_head,
-                     conn->pool->querying_tail,
-                     conn);
+
+  /*
+   * syncing after every query keeps errors
+   * from aborting the following ones
+   */
+  if (conn->pipelined && 0 == PQpipelineSync(conn->pg_conn))
+    goto query_error;
+
+  if (was_idle)
+    PQNB_querying_push(conn->pool->querying_head,
+                       conn->pool->querying_tail,
+                       conn);
+  conn->action = CONN_FLUSHING;
   return 0;
 query_error:
-  PQNB_connection_cb_err(conn);
-  PQNB_connection_reset(conn);
+  PQNB_connection_fail(conn, PQerrorMessage(conn->pg_conn), false);
   return -1;
 }
 
+int
+PQNB_connection_flush(struct PQNB_connection *conn)
+{
+  const int res = PQNB_connection_write(conn);
+
+  if (-1 == res)
+    {
+      PQNB_connection_fail(conn, PQerrorMessage(conn->pg_conn), false);
+      return -1;
+    }
+  conn->action = 0 == res ? CONN_QUERYING : CONN_FLUSHING;
+  PQNB_connection_schedule(conn);
+  return 0;
+}
+
+int
+PQNB_connection_query(struct PQNB_connection *conn,
+                      struct PQNB_query_request *req)
+{
+  if (-1 == PQNB_connection_send(conn, req))
+    return -1;
+  return PQNB_connection_flush(conn);
+}
+
+void
+PQNB_connection_stream(struct PQNB_connection *conn,
+                       struct PQNB_query_request *req)
+{
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  if (1 < req->stream_rows)
+    {
+      PQsetChunkedRowsMode(conn->pg_conn, req->stream_rows);
+      return;
+    }
+#else
+  (void) req;
+#endif
+  PQsetSingleRowMode(conn->pg_conn);
+}
+
 void
 PQNB_connection_clear_data(struct PQNB_connection *conn)
 {
-  conn->query_cb = NULL;
-  conn->user_data = NULL;
+  while (NULL != PQNB_connection_pop(conn, false));
 }
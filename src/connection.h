@@ -4,7 +4,8 @@
 #include "internal.h"
 
 struct PQNB_connection *
-PQNB_connection_init(struct PQNB_pool *pool, const char *conninfo);
+PQNB_connection_init(struct PQNB_pool *pool, struct PQNB_host *host,
+                     const char *conninfo);
 
 void
 PQNB_connection_free(struct PQNB_connection *conn);
@@ -15,20 +16,143 @@ PQNB_connection_begin_polling(struct PQNB_connection *conn);
 int
 PQNB_connection_reset(struct PQNB_connection *conn);
 
+/*
+ * sets the idle timeout, the caller schedules
+ */
+void
+PQNB_connection_idle(struct PQNB_connection *conn);
+
+/*
+ * connection established, puts the host back in rotation
+ */
+void
+PQNB_connection_connected(struct PQNB_connection *conn);
+
+/*
+ * PQconnectPoll / PQresetPoll failed, counts it against
+ * the host and starts over
+ */
+int
+PQNB_connection_connect_failed(struct PQNB_connection *conn);
+
+/*
+ * notifies every in-flight request and resets the connection
+ */
+int
+PQNB_connection_fail(struct PQNB_connection *conn,
+                     const char *error_msg, bool timeout);
+
 int
 PQNB_connection_read(struct PQNB_connection *conn);
 
 int
 PQNB_connection_write(struct PQNB_connection *conn);
 
+/*
+ * if the socket has unread data. libpq may stop reading short
+ * of EAGAIN, edge triggered epoll doesn't report what's left.
+ * Only checked once after each read
+ */
+bool
+PQNB_connection_pending(struct PQNB_connection *conn);
+
+/*
+ * notifies every in-flight request about the timeout and cancels the
+ * running query, discarding its results. Connections that can't be
+ * cancelled are reset
+ */
+int
+PQNB_connection_cancel(struct PQNB_connection *conn);
+
+/*
+ * advances the cancel request
+ */
+void
+PQNB_connection_cancel_poll(struct PQNB_connection *conn);
+
+/*
+ * handles the connection timer expiring
+ */
+void
+PQNB_connection_expire(struct PQNB_connection *conn);
+
+/*
+ * refreshes inactivity deadlines on connection events
+ */
+void
+PQNB_connection_touch(struct PQNB_connection *conn);
+
+/*
+ * arms the connection timer to its earliest deadline
+ */
+void
+PQNB_connection_schedule(struct PQNB_connection *conn);
+
+/*
+ * if the cancel request is still being sent
+ */
+bool
+PQNB_connection_cancelling(struct PQNB_connection *conn);
+
+/*
+ * if the connection can take one more query
+ */
+bool
+PQNB_connection_has_slot(struct PQNB_connection *conn);
+
+/*
+ * if the connection can take the request now,
+ * COPY needs a connection on its own
+ */
+bool
+PQNB_connection_accepts(struct PQNB_connection *conn,
+                        struct PQNB_query_request *req);
+
+/*
+ * if the request can join the batch being sent on the
+ * connection, see PQNB_OPT_BATCH_SIZE
+ */
+bool
+PQNB_connection_batches(struct PQNB_connection *conn,
+                        struct PQNB_query_request *req);
+
+/*
+ * buffers the request commands without flushing them.
+ * returns 0 on success, -1 on error, failures are notified
+ */
+int
+PQNB_connection_send(struct PQNB_connection *conn,
+                     struct PQNB_query_request *req);
+
+/*
+ * flushes the sent requests.
+ * returns 0 on success, -1 if the connection failed
+ */
+int
+PQNB_connection_flush(struct PQNB_connection *conn);
+
+/*
+ * sends and flushes the request
+ */
 int
 PQNB_connection_query(struct PQNB_connection *conn,
                       struct PQNB_query_request *req);
 
+/*
+ * oldest in-flight request, completed ones are
+ * accounted on the host latency
+ */
+struct PQNB_query_request *
+PQNB_connection_pop(struct PQNB_connection *conn, bool completed);
+
+/*
+ * switches the current query to single row / chunked mode
+ */
 void
-PQNB_connection_clear_data(struct PQNB_connection *conn);
+PQNB_connection_stream(struct PQNB_connection *conn,
+                       struct PQNB_query_request *req);
 
 void
-PQNB_connection_cb_err(struct PQNB_connection *conn);
+PQNB_connection_clear_data(struct PQNB_connection *conn);
 
 #endif /* ~PQNB_CONNECTION_H */
@@ -0,0 +1,85 @@
+#include "pqnb.h"
+
+#include "internal.h"
+#include "connection.h"
+#include "copy.h"
+
+#include <libpq-fe.h>
+
+int
+PQNB_copy_put(struct PQNB_copy *copy, const char *data, int len)
+{
+  struct PQNB_connection *conn = (struct PQNB_connection *) copy;
+  int res;
+
+  if (CONN_COPY_IN != conn->action)
+    return -1;
+  /*
+   * in non blocking mode libpq grows its buffer instead of
+   * blocking, the flush result is our backpressure
+   */
+  if (1 != PQputCopyData(conn->pg_conn, data, len))
+    goto copy_error;
+  res = PQNB_connection_write(conn);
+  if (-1 == res)
+    goto copy_error;
+  return res;
+copy_error:
+  PQNB_connection_fail(conn, PQerrorMessage(conn->pg_conn), false);
+  return -1;
+}
+
+int
+PQNB_copy_end(struct PQNB_copy *copy, const char *error_msg)
+{
+  struct PQNB_connection *conn = (struct PQNB_connection *) copy;
+  int res;
+
+  if (CONN_COPY_IN != conn->action)
+    return -1;
+  if (1 != PQputCopyEnd(conn->pg_conn, error_msg))
+    goto copy_error;
+  res = PQNB_connection_write(conn);
+  if (-1 == res)
+    goto copy_error;
+  /* waiting for the final result */
+  conn->action = 0 == res ? CONN_QUERYING : CONN_FLUSHING;
+  return 0;
+copy_error:
+  PQNB_connection_fail(conn, PQerrorMessage(conn->pg_conn), false);
+  return -1;
+}
+
+int
+PQNB_copy_drain(struct PQNB_connection *conn,
+                struct PQNB_query_request *req)
+{
+  char *data;
+  int len;
+
+  while (0 < (len = PQgetCopyData(conn->pg_conn, &data, 1)))
+    {
+      req->copy_cb((struct PQNB_copy *) conn, PQNB_COPY_DATA,
+                   data, len, req->user_data);
+      PQfreemem(data);
+      if (CONN_COPY_OUT != conn->action)
+        return 0;
+    }
+  if (0 == len)
+    return 0;
+  if (-1 == len)
+    return 1;
+  return -1;
+}
+
+int
+PQNB_copy_flush(struct PQNB_connection *conn,
+                struct PQNB_query_request *req)
+{
+  const int res = PQNB_connection_write(conn);
+
+  if (0 == res)
+    req->copy_cb((struct PQNB_copy *) conn, PQNB_COPY_WRITABLE,
+                 NULL, 0, req->user_data);
+  return res;
+}
@@ -0,0 +1,22 @@
+#ifndef PQNB_COPY_H
+#define PQNB_COPY_H
+
+#include "internal.h"
+
+/*
+ * passes the received COPY TO STDOUT data to the request.
+ * returns 1 once the copy is done, 0 if waiting for data, -1 on error
+ */
+int
+PQNB_copy_drain(struct PQNB_connection *conn,
+                struct PQNB_query_request *req);
+
+/*
+ * flushes COPY FROM STDIN data, asking for more once
+ * everything was sent. returns -1 on error
+ */
+int
+PQNB_copy_flush(struct PQNB_connection *conn,
+                struct PQNB_query_request *req);
+
+#endif /* ~PQNB_COPY_H */
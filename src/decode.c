@@ -0,0 +1,319 @@
+#include "pqnb.h"
+
+#include <libpq-fe.h>
+
+#include <endian.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * catalog OIDs, see pg_type.dat
+ */
+#define PQNB_BOOLOID 16
+#define PQNB_BYTEAOID 17
+#define PQNB_INT8OID 20
+#define PQNB_INT2OID 21
+#define PQNB_INT4OID 23
+#define PQNB_TEXTOID 25
+#define PQNB_FLOAT4OID 700
+#define PQNB_FLOAT8OID 701
+#define PQNB_BPCHAROID 1042
+#define PQNB_VARCHAROID 1043
+#define PQNB_TIMESTAMPOID 1114
+#define PQNB_TIMESTAMPTZOID 1184
+#define PQNB_UUIDOID 2950
+
+/*
+ * microseconds between the unix and postgres epochs
+ */
+#define PQNB_POSTGRES_EPOCH_USEC 946684800000000LL
+
+/*
+ * decodes len bytes of a binary value into dst,
+ * returns -1 on unexpected lengths
+ */
+typedef int (*PQNB_decoder)(const char *value, int len, void *dst);
+
+struct PQNB_field_decoder
+{
+  int column;
+  Oid type;
+  size_t offset;
+  ptrdiff_t null_offset;
+  /*
+   * bytes zeroed on NULL
+   */
+  size_t size;
+  PQNB_decoder decode;
+};
+
+struct PQNB_row_layout
+{
+  size_t row_size;
+  size_t num_fields;
+  struct PQNB_field_decoder fields[];
+};
+
+static uint16_t
+PQNB_decode_be16(const char *value)
+{
+  uint16_t be;
+
+  memcpy(&be, value, sizeof(be));
+  return be16toh(be);
+}
+
+static uint32_t
+PQNB_decode_be32(const char *value)
+{
+  uint32_t be;
+
+  memcpy(&be, value, sizeof(be));
+  return be32toh(be);
+}
+
+static uint64_t
+PQNB_decode_be64(const char *value)
+{
+  uint64_t be;
+
+  memcpy(&be, value, sizeof(be));
+  return be64toh(be);
+}
+
+/*
+ * integer column into a C integer at least as wide
+ */
+#define PQNB_DECODE_INT(name, bits, c_type)                      \
+static int                                                       \
+name(const char *value, int len, void *dst)                      \
+{                                                                \
+  c_type decoded;                                                \
+  if ((bits) / 8 != len)                                         \
+    return -1;                                                   \
+  decoded = (int##bits##_t) PQNB_decode_be##bits(value);         \
+  memcpy(dst, &decoded, sizeof(decoded));                        \
+  return 0;                                                      \
+}
+
+PQNB_DECODE_INT(PQNB_decode_int2_int16, 16, int16_t)
+PQNB_DECODE_INT(PQNB_decode_int2_int32, 16, int32_t)
+PQNB_DECODE_INT(PQNB_decode_int2_int64, 16, int64_t)
+PQNB_DECODE_INT(PQNB_decode_int4_int32, 32, int32_t)
+PQNB_DECODE_INT(PQNB_decode_int4_int64, 32, int64_t)
+PQNB_DECODE_INT(PQNB_decode_int8_int64, 64, int64_t)
+
+static int
+PQNB_decode_float4_float(const char *value, int len, void *dst)
+{
+  uint32_t bits;
+
+  if (4 != len)
+    return -1;
+  bits = PQNB_decode_be32(value);
+  memcpy(dst, &bits, sizeof(bits));
+  return 0;
+}
+
+static int
+PQNB_decode_float4_double(const char *value, int len, void *dst)
+{
+  uint32_t bits;
+  float decoded;
+  double widened;
+
+  if (4 != len)
+    return -1;
+  bits = PQNB_decode_be32(value);
+  memcpy(&decoded, &bits, sizeof(decoded));
+  widened = decoded;
+  memcpy(dst, &widened, sizeof(widened));
+  return 0;
+}
+
+static int
+PQNB_decode_float8_double(const char *value, int len, void *dst)
+{
+  uint64_t bits;
+
+  if (8 != len)
+    return -1;
+  bits = PQNB_decode_be64(value);
+  memcpy(dst, &bits, sizeof(bits));
+  return 0;
+}
+
+static int
+PQNB_decode_bool(const char *value, int len, void *dst)
+{
+  bool decoded;
+
+  if (1 != len)
+    return -1;
+  decoded = '\0' != value[0];
+  memcpy(dst, &decoded, sizeof(decoded));
+  return 0;
+}
+
+/*
+ * infinity keeps the INT64_MIN / INT64_MAX postgres uses
+ */
+static int
+PQNB_decode_timestamp(const char *value, int len, void *dst)
+{
+  int64_t decoded;
+
+  if (8 != len)
+    return -1;
+  decoded = (int64_t) PQNB_decode_be64(value);
+  if (INT64_MIN != decoded && INT64_MAX != decoded)
+    decoded += PQNB_POSTGRES_EPOCH_USEC;
+  memcpy(dst, &decoded, sizeof(decoded));
+  return 0;
+}
+
+static int
+PQNB_decode_uuid(const char *value, int len, void *dst)
+{
+  if (16 != len)
+    return -1;
+  memcpy(dst, value, 16);
+  return 0;
+}
+
+static int
+PQNB_decode_bytes(const char *value, int len, void *dst)
+{
+  const struct PQNB_bytes decoded = { value, (size_t) len };
+
+  memcpy(dst, &decoded, sizeof(decoded));
+  return 0;
+}
+
+/*
+ * supported column type / C type pairs
+ */
+static const struct
+{
+  Oid type;
+  enum PQNB_field_type c_type;
+  size_t size;
+  PQNB_decoder decode;
+} PQNB_decoders[] = {
+  { PQNB_INT2OID, PQNB_FIELD_INT16, 2, PQNB_decode_int2_int16 },
+  { PQNB_INT2OID, PQNB_FIELD_INT32, 4, PQNB_decode_int2_int32 },
+  { PQNB_INT2OID, PQNB_FIELD_INT64, 8, PQNB_decode_int2_int64 },
+  { PQNB_INT4OID, PQNB_FIELD_INT32, 4, PQNB_decode_int4_int32 },
+  { PQNB_INT4OID, PQNB_FIELD_INT64, 8, PQNB_decode_int4_int64 },
+  { PQNB_INT8OID, PQNB_FIELD_INT64, 8, PQNB_decode_int8_int64 },
+  { PQNB_FLOAT4OID, PQNB_FIELD_FLOAT, 4, PQNB_decode_float4_float },
+  { PQNB_FLOAT4OID, PQNB_FIELD_DOUBLE, 8, PQNB_decode_float4_double },
+  { PQNB_FLOAT8OID, PQNB_FIELD_DOUBLE, 8, PQNB_decode_float8_double },
+  { PQNB_BOOLOID, PQNB_FIELD_BOOL, sizeof(bool), PQNB_decode_bool },
+  { PQNB_TIMESTAMPOID, PQNB_FIELD_TIMESTAMP, 8, PQNB_decode_timestamp },
+  { PQNB_TIMESTAMPTZOID, PQNB_FIELD_TIMESTAMP, 8, PQNB_decode_timestamp },
+  { PQNB_UUIDOID, PQNB_FIELD_UUID, 16, PQNB_decode_uuid },
+  { PQNB_BYTEAOID, PQNB_FIELD_BYTES, sizeof(struct PQNB_bytes),
+    PQNB_decode_bytes },
+  { PQNB_TEXTOID, PQNB_FIELD_BYTES, sizeof(struct PQNB_bytes),
+    PQNB_decode_bytes },
+  { PQNB_VARCHAROID, PQNB_FIELD_BYTES, sizeof(struct PQNB_bytes),
+    PQNB_decode_bytes },
+  { PQNB_BPCHAROID, PQNB_FIELD_BYTES, sizeof(struct PQNB_bytes),
+    PQNB_decode_bytes },
+};
+
+struct PQNB_row_layout *
+PQNB_row_layout_init(const struct PQNB_field *fields, size_t num_fields,
+                     size_t row_size)
+{
+  struct PQNB_row_layout *layout;
+
+  layout = malloc(sizeof(*layout) + num_fields * sizeof(layout->fields[0]));
+  if (NULL == layout)
+    return NULL;
+  layout->row_size = row_size;
+  layout->num_fields = num_fields;
+
+  for (size_t i = 0; i < num_fields; i++)
+    {
+      struct PQNB_field_decoder *field = &layout->fields[i];
+      size_t j;
+
+      for (j = 0; j < sizeof(PQNB_decoders) / sizeof(PQNB_decoders[0]); j++)
+        if (PQNB_decoders[j].type == fields[i].type
+            && PQNB_decoders[j].c_type == fields[i].c_type)
+          break;
+      if (sizeof(PQNB_decoders) / sizeof(PQNB_decoders[0]) == j
+          || 0 > fields[i].column
+          || fields[i].offset + PQNB_decoders[j].size > row_size
+          || (PQNB_NOT_NULL != fields[i].null_offset
+              && (0 > fields[i].null_offset
+                  || (size_t) fields[i].null_offset + sizeof(bool)
+                     > row_size)))
+        {
+          free(layout);
+          return NULL;
+        }
+      field->column = fields[i].column;
+      field->type = fields[i].type;
+      field->offset = fields[i].offset;
+      field->null_offset = fields[i].null_offset;
+      field->size = PQNB_decoders[j].size;
+      field->decode = PQNB_decoders[j].decode;
+    }
+  return layout;
+}
+
+void
+PQNB_row_layout_free(struct PQNB_row_layout *layout)
+{
+  free(layout);
+}
+
+int
+PQNB_result_decode(const struct PQNB_row_layout *layout,
+                   const PGresult *result, void *rows, int max_rows)
+{
+  const int num_rows = PQntuples(result);
+  const int num_columns = PQnfields(result);
+  const int decoded = num_rows < max_rows ? num_rows : max_rows;
+
+  /* checked once per result instead of per value */
+  for (size_t i = 0; i < layout->num_fields; i++)
+    {
+      const struct PQNB_field_decoder *field = &layout->fields[i];
+      if (field->column >= num_columns
+          || 1 != PQfformat(result, field->column)
+          || field->type != PQftype(result, field->column))
+        return -1;
+    }
+
+  for (int row = 0; row < decoded; row++)
+    {
+      char *dst = (char*) rows + (size_t) row * layout->row_size;
+      for (size_t i = 0; i < layout->num_fields; i++)
+        {
+          const struct PQNB_field_decoder *field = &layout->fields[i];
+          const bool null = PQgetisnull(result, row, field->column);
+
+          if (PQNB_NOT_NULL != field->null_offset)
+            memcpy(dst + field->null_offset, &null, sizeof(null));
+          if (null)
+            {
+              if (PQNB_NOT_NULL == field->null_offset)
+                return -1;
+              memset(dst + field->offset, 0, field->size);
+              continue;
+            }
+          if (-1 == field->decode(PQgetvalue(result, row, field->column),
+                                  PQgetlength(result, row, field->column),
+                                  dst + field->offset))
+            return -1;
+        }
+    }
+  return decoded;
+}
@@ -0,0 +1,246 @@
+#include "flight.h"
+#include "result_cache.h"
+
+#include <libpq-fe.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * power of two, flights only last as long as their request
+ */
+#define PQNB_FLIGHT_BUCKETS 1024
+/*
+ * waiters initial entries, it doubles as needed
+ */
+#define PQNB_FLIGHT_WAITERS_INITIAL 4
+
+struct PQNB_flight_waiter
+{
+  PQNB_query_cb query_cb;
+  void *user_data;
+};
+
+struct PQNB_flight
+{
+  /*
+   * hash of the key
+   */
+  uint64_t hash;
+  struct PQNB_flights *flights;
+  /*
+   * next flight on the same hash bucket, while joinable
+   */
+  struct PQNB_flight *next_bucket;
+  /*
+   * flights not yet landed, or landed ones not yet collected
+   */
+  struct PQNB_flight *prev;
+  struct PQNB_flight *next;
+  /*
+   * the request callback first, then the attached ones
+   */
+  struct PQNB_flight_waiter *waiters;
+  size_t num_waiters;
+  size_t max_waiters;
+  /*
+   * on its hash bucket, until first notified or landed
+   */
+  bool joinable;
+  /*
+   * serialized query and params
+   */
+  size_t key_len;
+  char key[];
+};
+
+struct PQNB_flights
+{
+  struct PQNB_flight *buckets[PQNB_FLIGHT_BUCKETS];
+  struct PQNB_flight *flying;
+  struct PQNB_flight *landed;
+};
+
+static struct PQNB_flight **
+PQNB_flight_find(struct PQNB_flights *flights, const char *key,
+                 size_t key_len, uint64_t hash)
+{
+  struct PQNB_flight **link;
+
+  link = &flights->buckets[hash & (PQNB_FLIGHT_BUCKETS - 1)];
+  while (NULL != *link)
+    {
+      if (hash == (*link)->hash && key_len == (*link)->key_len
+          && 0 == memcmp((*link)->key, key, key_len))
+        break;
+      link = &(*link)->next_bucket;
+    }
+  return link;
+}
+
+/*
+ * takes it off its hash bucket, later identical queries
+ * start a flight of their own
+ */
+static void
+PQNB_flight_unlink(struct PQNB_flight *flight)
+{
+  struct PQNB_flights *flights = flight->flights;
+  struct PQNB_flight **link;
+
+  if (!flight->joinable)
+    return;
+  link = &flights->buckets[flight->hash & (PQNB_FLIGHT_BUCKETS - 1)];
+  while (flight != *link)
+    link = &(*link)->next_bucket;
+  *link = flight->next_bucket;
+  flight->joinable = false;
+}
+
+static void
+PQNB_flight_free_list(struct PQNB_flight *flight)
+{
+  struct PQNB_flight *next;
+
+  for (; NULL != flight; flight = next)
+    {
+      next = flight->next;
+      free(flight->waiters);
+      free(flight);
+    }
+}
+
+struct PQNB_flights *
+PQNB_flights_init(void)
+{
+  return calloc(1, sizeof(struct PQNB_flights));
+}
+
+void
+PQNB_flights_free(struct PQNB_flights *flights)
+{
+  PQNB_flight_free_list(flights->flying);
+  PQNB_flight_free_list(flights->landed);
+  free(flights);
+}
+
+bool
+PQNB_flight_join(struct PQNB_flights *flights,
+                 const struct PQNB_query *query,
+                 PQNB_query_cb query_cb, const void *user_data)
+{
+  char stack[PQNB_RESULT_KEY_STACK], *key;
+  struct PQNB_flight_waiter *waiters;
+  struct PQNB_flight *flight;
+  size_t key_len;
+
+  key = PQNB_result_key(query, stack, &key_len);
+  if (NULL == key)
+    return false;
+  flight = *PQNB_flight_find(flights, key, key_len,
+                             PQNB_result_hash(key, key_len));
+  if (stack != key)
+    free(key);
+  if (NULL == flight)
+    return false;
+  if (flight->num_waiters == flight->max_waiters)
+    {
+      waiters = realloc(flight->waiters,
+                        2 * flight->max_waiters * sizeof(*waiters));
+      if (NULL == waiters)
+        return false;
+      flight->waiters = waiters;
+      flight->max_waiters *= 2;
+    }
+  flight->waiters[flight->num_waiters].query_cb = query_cb;
+  flight->waiters[flight->num_waiters].user_data = (void*) user_data;
+  flight->num_waiters++;
+  return true;
+}
+
+struct PQNB_flight *
+PQNB_flight_start(struct PQNB_flights *flights,
+                  const struct PQNB_query *query,
+                  PQNB_query_cb query_cb, const void *user_data)
+{
+  const size_t key_len = PQNB_result_key_size(query);
+  struct PQNB_flight *flight, **link;
+
+  flight = malloc(sizeof(*flight) + key_len);
+  if (NULL == flight)
+    return NULL;
+  flight->waiters = malloc(PQNB_FLIGHT_WAITERS_INITIAL
+                           * sizeof(*flight->waiters));
+  if (NULL == flight->waiters)
+    {
+      free(flight);
+      return NULL;
+    }
+  PQNB_result_key_write(query, flight->key);
+  flight->key_len = key_len;
+  flight->hash = PQNB_result_hash(flight->key, key_len);
+  flight->flights = flights;
+  flight->waiters[0].query_cb = query_cb;
+  flight->waiters[0].user_data = (void*) user_data;
+  flight->num_waiters = 1;
+  flight->max_waiters = PQNB_FLIGHT_WAITERS_INITIAL;
+
+  /* ahead of one that couldn't be joined */
+  link = &flights->buckets[flight->hash & (PQNB_FLIGHT_BUCKETS - 1)];
+  flight->next_bucket = *link;
+  *link = flight;
+  flight->joinable = true;
+
+  flight->prev = NULL;
+  flight->next = flights->flying;
+  if (NULL != flights->flying)
+    flights->flying->prev = flight;
+  flights->flying = flight;
+  return flight;
+}
+
+void
+PQNB_flight_notify(PGresult *result, void *user_data,
+                   char *error_msg, bool timeout)
+{
+  struct PQNB_flight *flight = user_data;
+
+  /* attached from now on, they would miss this result */
+  PQNB_flight_unlink(flight);
+  for (size_t i = 0; i < flight->num_waiters; i++)
+    flight->waiters[i].query_cb(result, flight->waiters[i].user_data,
+                                error_msg, timeout);
+}
+
+void *
+PQNB_flight_user_data(const struct PQNB_flight *flight)
+{
+  return flight->waiters[0].user_data;
+}
+
+void
+PQNB_flight_land(struct PQNB_flight *flight)
+{
+  struct PQNB_flights *flights = flight->flights;
+
+  PQNB_flight_unlink(flight);
+  if (NULL == flight->prev)
+    flights->flying = flight->next;
+  else
+    flight->prev->next = flight->next;
+  if (NULL != flight->next)
+    flight->next->prev = flight->prev;
+  /* its callbacks may still be running, or about to */
+  flight->prev = NULL;
+  flight->next = flights->landed;
+  flights->landed = flight;
+}
+
+void
+PQNB_flights_collect(struct PQNB_flights *flights)
+{
+  PQNB_flight_free_list(flights->landed);
+  flights->landed = NULL;
+}
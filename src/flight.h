@@ -0,0 +1,82 @@
+#ifndef PQNB_FLIGHT_H
+#define PQNB_FLIGHT_H
+
+#include "pqnb.h"
+
+#include <libpq-fe.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * PQNB_QUERY_SINGLE_FLIGHT requests queued or in flight, keyed
+ * by query and params like the result cache. Single threaded
+ */
+struct PQNB_flights;
+
+/*
+ * one request whose results are passed to every waiter
+ */
+struct PQNB_flight;
+
+/*
+ * NULL on allocation errors
+ */
+struct PQNB_flights *
+PQNB_flights_init(void);
+
+/*
+ * frees the flights of the requests dropped along with the pool
+ */
+void
+PQNB_flights_free(struct PQNB_flights *flights);
+
+/*
+ * attaches the callback to the flight of the same query and
+ * params, if there is one not yet notified.
+ * returns true if it was attached
+ */
+bool
+PQNB_flight_join(struct PQNB_flights *flights,
+                 const struct PQNB_query *query,
+                 PQNB_query_cb query_cb, const void *user_data);
+
+/*
+ * starts the flight of a request, the request then calls
+ * PQNB_flight_notify with the flight as user data.
+ * NULL on allocation errors
+ */
+struct PQNB_flight *
+PQNB_flight_start(struct PQNB_flights *flights,
+                  const struct PQNB_query *query,
+                  PQNB_query_cb query_cb, const void *user_data);
+
+/*
+ * the request callback, passes the result to the callback of
+ * the request and those attached since, in that order. No
+ * callback is attached once notified
+ */
+void
+PQNB_flight_notify(PGresult *result, void *user_data,
+                   char *error_msg, bool timeout);
+
+/*
+ * user data of the request callback
+ */
+void *
+PQNB_flight_user_data(const struct PQNB_flight *flight);
+
+/*
+ * the request is done, the flight is freed by the
+ * next PQNB_flights_collect
+ */
+void
+PQNB_flight_land(struct PQNB_flight *flight);
+
+/*
+ * frees the landed flights, their callbacks were all notified
+ */
+void
+PQNB_flights_collect(struct PQNB_flights *flights);
+
+#endif /* ~PQNB_FLIGHT_H */
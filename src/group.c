@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "pqnb.h"
+
+#include "internal.h"
+#include "group.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * max requests handed to a hungry shard at once
+ */
+#define PQNB_GROUP_DONATE_MAX 32
+
+/*
+ * shard of the calling thread, NULL outside shard threads
+ */
+static _Thread_local struct PQNB_shard *PQNB_local_shard;
+
+struct PQNB_pool_group *
+PQNB_group_init(const char *conninfo, uint16_t num_shards,
+                uint16_t num_connections)
+{
+  struct PQNB_pool_group *group;
+
+  if (0 == num_shards)
+    return NULL;
+  group = calloc(1, sizeof(*group));
+  if (NULL == group)
+    return NULL;
+  atomic_init(&group->stopping, false);
+  atomic_init(&group->next_shard, 0);
+  group->shards = calloc(num_shards, sizeof(*group->shards));
+  if (NULL == group->shards)
+    goto cleanup;
+
+  for (uint16_t i = 0; i < num_shards; i++)
+    {
+      struct PQNB_shard *shard = &group->shards[i];
+      shard->pool = PQNB_pool_init(conninfo, num_connections);
+      if (NULL == shard->pool)
+        goto cleanup;
+      shard->group = group;
+      shard->pool->shard = shard;
+      atomic_init(&shard->hungry, false);
+      group->num_shards++;
+    }
+
+  return group;
+cleanup:
+  for (uint16_t j = 0; j < group->num_shards; j++)
+    PQNB_pool_free(group->shards[j].pool);
+  free(group->shards);
+  free(group);
+  return NULL;
+}
+
+void
+PQNB_group_free(struct PQNB_pool_group *group)
+{
+  atomic_store(&group->stopping, true);
+  for (uint16_t i = 0; i < group->num_shards; i++)
+    if (group->shards[i].started)
+      PQNB_pool_wakeup(group->shards[i].pool);
+  for (uint16_t i = 0; i < group->num_shards; i++)
+    if (group->shards[i].started)
+      pthread_join(group->shards[i].thread, NULL);
+  for (uint16_t i = 0; i < group->num_shards; i++)
+    PQNB_pool_free(group->shards[i].pool);
+  free(group->shards);
+  free(group);
+}
+
+int
+PQNB_group_set_option(struct PQNB_pool_group *group,
+                      enum PQNB_pool_option_type type,
+                      const union PQNB_pool_option *option)
+{
+  for (uint16_t i = 0; i < group->num_shards; i++)
+    if (-1 == PQNB_pool_set_option(group->shards[i].pool, type, option))
+      return -1;
+  return 0;
+}
+
+static void *
+PQNB_group_thread(void *arg)
+{
+  struct PQNB_shard *shard = arg;
+  struct PQNB_pool_group *group = shard->group;
+  struct pollfd pfd;
+
+  PQNB_local_shard = shard;
+  pfd.fd = shard->pool->epoll_fd;
+  pfd.events = POLLIN;
+
+  while (!atomic_load(&group->stopping))
+    {
+      if (-1 == poll(&pfd, 1, -1))
+        continue;
+      PQNB_pool_run(shard->pool);
+    }
+  return NULL;
+}
+
+int
+PQNB_group_start(struct PQNB_pool_group *group)
+{
+  const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpus;
+
+  for (uint16_t i = 0; i < group->num_shards; i++)
+    {
+      struct PQNB_shard *shard = &group->shards[i];
+      if (0 != pthread_create(&shard->thread, NULL,
+                              PQNB_group_thread, shard))
+        return -1;
+      shard->started = true;
+      if (0 < num_cpus)
+        {
+          CPU_ZERO(&cpus);
+          CPU_SET(i % num_cpus, &cpus);
+          /* best effort, the shard still runs unpinned */
+          pthread_setaffinity_np(shard->thread, sizeof(cpus), &cpus);
+        }
+    }
+  return 0;
+}
+
+int
+PQNB_group_query(struct PQNB_pool_group *group,
+                 const struct PQNB_query *query,
+                 PQNB_query_cb query_cb,
+                 const void *user_data)
+{
+  struct PQNB_shard *shard = PQNB_local_shard;
+  unsigned int i;
+
+  if (NULL != shard && group == shard->group)
+    return PQNB_pool_query_ex(shard->pool, query, query_cb, user_data);
+
+  i = atomic_fetch_add_explicit(&group->next_shard, 1,
+                                memory_order_relaxed);
+  return PQNB_pool_query_mt(group->shards[i % group->num_shards].pool,
+                            query, query_cb, user_data);
+}
+
+void
+PQNB_group_balance(struct PQNB_shard *shard)
+{
+  struct PQNB_pool_group *group = shard->group;
+  struct PQNB_pool *pool = shard->pool;
+  const uint16_t n = group->num_shards;
+  const uint16_t self = shard - group->shards;
+  struct PQNB_shard *other;
+  bool idle = false;
+  size_t max;
+
+  for (uint16_t h = 0; h < pool->num_hosts && !idle; h++)
+    idle = NULL != pool->hosts[h].idle_head;
+  atomic_store_explicit(&shard->hungry, idle && 0 == pool->queued,
+                        memory_order_relaxed);
+
+  for (uint16_t i = 1; i < n && 0 < pool->queued; i++)
+    {
+      other = &group->shards[(self + i) % n];
+      /* claimed, other shards won't feed it as well */
+      if (!atomic_load_explicit(&other->hungry, memory_order_relaxed)
+          || !atomic_exchange(&other->hungry, false))
+        continue;
+      max = (pool->queued + 1) / 2;
+      if (PQNB_GROUP_DONATE_MAX < max)
+        max = PQNB_GROUP_DONATE_MAX;
+      PQNB_pool_donate(pool, other->pool, max);
+    }
+}
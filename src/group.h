@@ -0,0 +1,44 @@
+#ifndef PQNB_GROUP_H
+#define PQNB_GROUP_H
+
+#include "pqnb.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/*
+ * a pool and the thread running it
+ */
+struct PQNB_shard
+{
+  struct PQNB_pool_group *group;
+  struct PQNB_pool *pool;
+  pthread_t thread;
+  /*
+   * has idle connections and nothing queued, published
+   * after each run for the other shards
+   */
+  atomic_bool hungry;
+  bool started;
+};
+
+struct PQNB_pool_group
+{
+  struct PQNB_shard *shards;
+  uint16_t num_shards;
+  atomic_bool stopping;
+  /*
+   * round robin for threads outside the group
+   */
+  atomic_uint next_shard;
+};
+
+/*
+ * publishes the shard state and hands queued requests
+ * to hungry shards. Shard thread only
+ */
+void
+PQNB_group_balance(struct PQNB_shard *shard);
+
+#endif /* ~PQNB_GROUP_H */
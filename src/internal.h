@@ -3,13 +3,31 @@
 
 #include "pqnb.h"
 #include "ring_buffer.h"
+#include "stmt_cache.h"
+#include "result_cache.h"
+#include "flight.h"
+#include "timer.h"
+#include "mpsc.h"
+#include "stats.h"
+#include "slab.h"
 
 #include <libpq-fe.h>
 
 #include <assert.h>
 #include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
 
+/*
+ * queries buffer initial entries, it doubles up to the capacity
+ */
+#define PQNB_QBUF_INITIAL 64
+
+#define PQNB_container_of(ptr, type, member) \
+  ((type *) ((char *) (ptr) - offsetof(type, member)))
+
 #define PQNB_idle_push(head, tail, c) do {   \
     assert(NULL == (c)->next_idle);          \
     assert(NULL == (c)->prev_idle);          \
@@ -22,6 +40,9 @@
     (tail) = (c);                            \
 } while (0)                                  \
 
+#define PQNB_idle_listed(head, c) \
+  ((head) == (c) || NULL != (c)->prev_idle)
+
 #define PQNB_idle_remove(head, tail, c) do {      \
   if (NULL == (c)->prev_idle)                     \
     (head) = (c)->next_idle;                      \
@@ -84,6 +105,37 @@
   (c)->next_querying = NULL;                                    \
   (c)->prev_querying = NULL;                                    \
 } while(0)                                                      \
+
+/*
+ * no connection up and failing to connect
+ */
+#define PQNB_host_down(host) \
+  (0 == (host)->connected && PQNB_HOST_MAX_FAILURES <= (host)->failures)
+
+#define PQNB_conns_push(head, tail, c) do {  \
+    assert(NULL == (c)->next_conn);          \
+    assert(NULL == (c)->prev_conn);          \
+    (c)->prev_conn = (tail);                 \
+    (c)->next_conn = NULL;                   \
+    if (NULL == (head))                      \
+        (head) = (c);                        \
+    else                                     \
+      (tail)->next_conn = (c);               \
+    (tail) = (c);                            \
+} while (0)                                  \
+
+#define PQNB_conns_remove(head, tail, c) do {      \
+  if (NULL == (c)->prev_conn)                      \
+    (head) = (c)->next_conn;                       \
+  else                                             \
+    (c)->prev_conn->next_conn = (c)->next_conn;    \
+  if (NULL == (c)->next_conn)                      \
+    (tail) = (c)->prev_conn;                       \
+  else                                             \
+    (c)->next_conn->prev_conn = (c)->prev_conn;    \
+  (c)->next_conn = NULL;                           \
+  (c)->prev_conn = NULL;                           \
+} while(0)                                         \
                                               
 enum PQNB_connection_action
 {
@@ -92,7 +144,13 @@ enum PQNB_connection_action
   CONN_IDLE,
   CONN_FLUSHING,
   CONN_QUERYING,
-  CONN_CANCELLING
+  CONN_CANCELLING,
+  CONN_COPY_IN,
+  CONN_COPY_OUT,
+  /*
+   * waiting to reconnect
+   */
+  CONN_BACKOFF
 };
 
 enum PQNB_connection_poll
@@ -106,25 +164,53 @@ enum PQNB_connection_poll
 struct PQNB_connection
 {
   /*
-   * last epoll activity
+   * armed to the earliest of deadline and the
+   * in-flight requests deadlines
+   */
+  struct PQNB_timer timer;
+  /*
+   * idle, connect, copy inactivity or cancel deadline, 0 if none
    */
-  time_t last_activity;
+  uint64_t deadline;
   /*
    * the pool this belongs to
    */
   struct PQNB_pool *pool;
+  /*
+   * server it connects to
+   */
+  struct PQNB_host *host;
   /* 
    *  postgres connection
    */
   PGconn *pg_conn;
-  /* 
-   * query callback, NULL after passing all results
+  /*
+   * in-flight query requests, oldest first. Holds a single
+   * request unless the connection is pipelined
    */
-  PQNB_query_cb query_cb;
+  struct PQNB_ring_buffer *requests;
   /*
-   * user data attached to query, NULL after passing all results
+   * prepared statements, NULL until the cache is enabled
    */
-  void *user_data;
+  struct PQNB_stmt_cache *stmt_cache;
+  /*
+   * session it is pinned to, NULL if shared
+   */
+  struct PQNB_session *session;
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  /*
+   * in progress cancel request, NULL if none
+   */
+  PGcancelConn *cancel_conn;
+#endif
+  /**
+   * next connection of the host
+   */
+  struct PQNB_connection *next_conn;
+  /**
+   * previous connection of the host
+   */
+  struct PQNB_connection *prev_conn;
   /**
    * next idle connection
    */
@@ -152,7 +238,7 @@ struct PQNB_connection
   /*
    * what the connection is currently doing
    */
-  uint32_t action: 3;
+  uint32_t action: 4;
   /* 
    * this is only used for connections and reconnections
    */
@@ -165,25 +251,94 @@ struct PQNB_connection
    * if we can read without blocking
    */
   uint32_t readable: 1;
+  /*
+   * if libpq pipeline mode is on
+   */
+  uint32_t pipelined: 1;
+  /*
+   * if it was read from since the socket was last checked for data
+   * libpq left behind
+   */
+  uint32_t unchecked: 1;
+  /*
+   * failed reconnects in a row, for the backoff
+   */
+  uint32_t attempts: 6;
 };
 
+struct PQNB_shard;
+struct PQNB_session;
+struct PQNB_channel;
+
 /*
- * connection pool
+ * database server, the primary or a replica
  */
-struct PQNB_pool
+struct PQNB_host
 {
+  char *conninfo;
+  /**
+   * all connections head
+   */
+  struct PQNB_connection *conns_head;
+  /**
+   * all connections tail
+   */
+  struct PQNB_connection *conns_tail;
+  uint16_t num_connections;
   /*
-   * all connections
+   * connections established and not lost since
    */
-  struct PQNB_connection **connections;
+  uint16_t connected;
   /**
-   * idle connections head
+   * idle connections head, pipelined connections
+   * with free slots are listed as well
    */
   struct PQNB_connection *idle_head;
   /**
    * idle connections tail
    */
   struct PQNB_connection *idle_tail;
+  /*
+   * EWMA of dispatch to completion in nanoseconds, 0 if unknown
+   */
+  uint64_t latency;
+  /*
+   * queries sent and not completed
+   */
+  uint32_t in_flight;
+  /*
+   * consecutive connection failures, reset on connecting
+   */
+  uint16_t failures;
+};
+
+/*
+ * query class queue
+ */
+struct PQNB_query_class
+{
+  struct PQNB_ring_buffer *queue;
+  /*
+   * requests it may dispatch per round
+   */
+  uint16_t weight;
+  /*
+   * requests left to dispatch on the current round
+   */
+  uint16_t deficit;
+  struct PQNB_class_stats stats;
+};
+
+/*
+ * connection pool
+ */
+struct PQNB_pool
+{
+  /*
+   * the primary first, then the replicas
+   */
+  struct PQNB_host *hosts;
+  uint16_t num_hosts;
   /**
    * (re)connecting connections head
    */
@@ -201,51 +356,421 @@ struct PQNB_pool
    */
   struct PQNB_connection *querying_tail;
   /*
-   * buffer of pending queries, filled if there's
+   * pending queries per class, filled if there's
    * no idle_connection and user requests a query
    */
-  struct PQNB_ring_buffer *queries_buffer;
+  struct PQNB_query_class classes[PQNB_MAX_QUERY_CLASSES];
   /*
-   * connection timeout in seconds for
+   * class being served by the round robin
+   */
+  uint8_t current_class;
+  /*
+   * connections timers
+   */
+  struct PQNB_timer_heap *conn_timers;
+  /*
+   * queued requests timers
+   */
+  struct PQNB_timer_heap *queue_timers;
+  /*
+   * backpressure callback, NULL if disabled
+   */
+  PQNB_watermark_cb watermark_cb;
+  void *watermark_data;
+  uint32_t high_watermark;
+  uint32_t low_watermark;
+  /*
+   * if the high watermark was signalled
+   */
+  bool above_watermark;
+  /*
+   * max queries buffer entries, all classes together
+   */
+  uint32_t queue_capacity;
+  /*
+   * queued requests not yet timed out
+   */
+  uint32_t queued;
+  /*
+   * connection timeout in nanoseconds for
    * connecting or reconnecting
    */
-  time_t connect_timeout;
+  uint64_t connect_timeout;
+  /*
+   * default query timeout in nanoseconds
+   */
+  uint64_t query_timeout;
+  /*
+   * clock of the current pool call
+   */
+  uint64_t now;
   /*
-   * default query timeout
+   * deadline timer_fd is armed to
    */
-  time_t query_timeout;
+  uint64_t timer_armed;
   /*
    * epoll file descriptor
    */
   int epoll_fd;
+  /*
+   * wakes epoll_fd up on deadlines
+   */
+  int timer_fd;
+  /*
+   * wakes epoll_fd up on queries posted from other threads
+   */
+  int event_fd;
+  /*
+   * queries posted from other threads
+   */
+  struct PQNB_mpsc *posted;
+  /*
+   * set by the first post after a drain, the rest
+   * don't need to write event_fd
+   */
+  atomic_bool wakeup_pending;
+  /*
+   * group shard it runs, NULL if standalone
+   */
+  struct PQNB_shard *shard;
   /*
    * total connections number
    */
   uint16_t num_connections;
+  /*
+   * connections bounds per host
+   */
+  uint16_t min_connections;
+  uint16_t max_connections;
+  /*
+   * queued requests tolerated before opening
+   * one more connection
+   */
+  uint32_t grow_threshold;
+  /*
+   * nanoseconds idle connections above the minimum
+   * are kept, 0 if forever
+   */
+  uint64_t idle_timeout;
+  /*
+   * reconnect backoff bounds in nanoseconds, doubling
+   * on each failed attempt
+   */
+  uint64_t backoff_min;
+  uint64_t backoff_max;
+  /*
+   * xorshift state for the backoff jitter
+   */
+  uint64_t rng;
+  /*
+   * max connections (re)connecting at once
+   */
+  uint16_t max_reconnects;
+  /*
+   * if queries were failed for the primary being down
+   */
+  bool breaker_open;
+  /*
+   * max in-flight queries per connection
+   */
+  uint16_t pipeline_depth;
+  /*
+   * max requests a connection takes from the queues at once,
+   * 0 or 1 if batching is disabled
+   */
+  uint16_t batch_size;
+  /*
+   * max prepared statements per connection, 0 if disabled
+   */
+  uint16_t statement_cache_size;
+  /*
+   * counters and histograms, gauges are filled by PQNB_pool_get_info
+   */
+  struct PQNB_pool_stats stats;
+  /*
+   * PQNB_QUERY_COPY queries and params
+   */
+  struct PQNB_slab *arena;
+  /*
+   * PQNB_QUERY_CACHE results, NULL if disabled
+   */
+  struct PQNB_result_cache *result_cache;
+  /*
+   * cached results time to live in nanoseconds, 0 if they don't expire
+   */
+  uint64_t cache_ttl;
+  /*
+   * PQNB_QUERY_SINGLE_FLIGHT requests, NULL until the first one
+   */
+  struct PQNB_flights *flights;
+  /*
+   * sessions not yet freed
+   */
+  struct PQNB_session *sessions;
+  /*
+   * subscribed channels, listened on the pinned connection of
+   * the listener session. NULL if none / not yet acquired
+   */
+  struct PQNB_channel *channels;
+  struct PQNB_session *listener;
+#ifdef PQNB_TRACE
+  /*
+   * lifecycle hook, NULL if disabled
+   */
+  PQNB_trace_cb trace_cb;
+  void *trace_data;
+#endif
 };
 
+/*
+ * query posted from another thread
+ */
+struct PQNB_query_post
+{
+  struct PQNB_mpsc_node node;
+  struct PQNB_query query;
+  PQNB_query_cb query_cb;
+  void *user_data;
+  /*
+   * CLOCK_MONOTONIC nanoseconds
+   */
+  uint64_t posted_at;
+  /*
+   * query and params of PQNB_QUERY_COPY posts
+   */
+  max_align_t owned[];
+};
+
+/*
+ * queues a post from any thread and wakes the pool up.
+ * returns 0 on success, -1 on error
+ */
+int
+PQNB_pool_post(struct PQNB_pool *pool, struct PQNB_query_post *post);
+
+/*
+ * makes the pool epoll fd readable, safe from any thread.
+ * returns 0 on success, -1 on error
+ */
+int
+PQNB_pool_wakeup(struct PQNB_pool *pool);
+
+/*
+ * moves up to max queued queries to another pool, in dispatch
+ * order. Pool thread only. returns the number moved
+ */
+size_t
+PQNB_pool_donate(struct PQNB_pool *pool, struct PQNB_pool *to, size_t max);
+
 /* 
  * query request
  */
 struct PQNB_query_request
 {
   /*
-   * time it was enqueued on the query buffer
+   * time it was submitted, CLOCK_MONOTONIC nanoseconds
    */
-  time_t enqueued_at;
+  uint64_t enqueued_at;
+  /*
+   * request deadline, armed while it is queued on the pool
+   */
+  struct PQNB_timer timer;
   /*
    * the sql query
    */
   char *query;
+  /*
+   * PQsendQueryParams arguments, num_params is 0
+   * and arrays are NULL for plain queries
+   */
+  const Oid *param_types;
+  const char *const *param_values;
+  const int *param_lengths;
+  const int *param_formats;
+  int num_params;
+  /*
+   * pool arena block the query and params above point
+   * into, released on completion. NULL if borrowed
+   */
+  void *owned;
+  /*
+   * 0 for text results, 1 for binary
+   */
+  int result_format;
+  /*
+   * time it was sent, CLOCK_MONOTONIC nanoseconds
+   */
+  uint64_t sent_at;
+  /*
+   * id of the statement being prepared, if preparing
+   */
+  uint64_t stmt_id;
+  /*
+   * queue it waits on
+   */
+  uint8_t query_class;
+  /*
+   * rows per batch if streaming, 0 otherwise
+   */
+  uint32_t stream_rows;
+  /*
+   * if single row / chunked mode was set
+   */
+  uint32_t streaming: 1;
+  /*
+   * leading deallocate of an evicted statement, synced on its
+   * own, and prepare of the query statement sent with the query.
+   * Cleared once their results are read, they aren't passed to
+   * the callback
+   */
+  uint32_t deallocating: 1;
+  uint32_t preparing: 1;
+  /*
+   * if the prepare failed, the query is aborted
+   */
+  uint32_t prepare_failed: 1;
+  /*
+   * timed out, the callback was already notified
+   * and results, if any, are discarded
+   */
+  uint32_t cancelled: 1;
+  /*
+   * may run on a replica
+   */
+  uint32_t read_only: 1;
+  /*
+   * if a result was already received, for the first result latency
+   */
+  uint32_t responded: 1;
+  /*
+   * its first result goes to the result cache
+   */
+  uint32_t cache: 1;
+#ifdef PQNB_TRACE
+  /*
+   * lifecycle events already traced
+   */
+  uint32_t flushed: 1;
+  uint32_t first_read: 1;
+#endif
   /*
    * user defined callback, we call it when we have
    * PGresult's available for reading
    */
   PQNB_query_cb query_cb;
+  /*
+   * NOTIFY channel of the cached result, NULL if none
+   */
+  const char *cache_channel;
+  /*
+   * PQNB_QUERY_SINGLE_FLIGHT requests, its results go to the
+   * identical queries attached since. NULL otherwise
+   */
+  struct PQNB_flight *flight;
+  /*
+   * COPY data callback, NULL for regular queries
+   */
+  PQNB_copy_cb copy_cb;
+  /*
+   * session acquiring a connection, pinned instead of
+   * sending a query. NULL for regular queries
+   */
+  struct PQNB_session *session;
   /*
    * user defined data
    */
   void *user_data;
 };
 
+/*
+ * queries pinned to a connection
+ */
+struct PQNB_session
+{
+  struct PQNB_pool *pool;
+  /*
+   * pinned connection, NULL until acquired and once lost
+   */
+  struct PQNB_connection *conn;
+  /*
+   * queries the connection can't take yet, oldest first
+   */
+  struct PQNB_ring_buffer *pending;
+  /**
+   * pool sessions list
+   */
+  struct PQNB_session *next;
+  struct PQNB_session *prev;
+  /*
+   * PQNB_session_flag bits
+   */
+  uint32_t flags;
+  /*
+   * the acquire request is queued
+   */
+  uint32_t acquiring: 1;
+  /*
+   * acquiring failed, the connection was lost or a query
+   * timed out. Queries are refused
+   */
+  uint32_t failed: 1;
+  /*
+   * PQNB_session_end was called
+   */
+  uint32_t ended: 1;
+  /*
+   * pending queries are being failed, freeing waits
+   */
+  uint32_t notifying: 1;
+  /*
+   * LISTENs for the pool channels, its connection
+   * is reset when given back
+   */
+  uint32_t listener: 1;
+};
+
+/*
+ * fills the request from the user query, copying it
+ * into the arena for PQNB_QUERY_COPY.
+ * returns 0 on success, -1 on allocation errors
+ */
+int
+PQNB_pool_request(struct PQNB_pool *pool, struct PQNB_query_request *req,
+                  const struct PQNB_query *user_query,
+                  PQNB_query_cb query_cb, const void *user_data);
+
+/*
+ * sends or queues the request, returns like PQNB_pool_query.
+ * Takes the request arena block whatever happens
+ */
+int
+PQNB_pool_submit(struct PQNB_pool *pool, struct PQNB_query_request *req,
+                 uint32_t timeout_ms);
+
+/*
+ * hands queued requests to the connection while it has free
+ * slots, leaving it idle listed if it can take more. With
+ * batching it takes up to a batch, flushed at once
+ */
+void
+PQNB_pool_fill(struct PQNB_pool *pool, struct PQNB_connection *conn);
+
+/*
+ * gives the request arena block back, if any
+ */
+void
+PQNB_pool_release(struct PQNB_pool *pool, struct PQNB_query_request *req);
+
+#ifdef PQNB_TRACE
+/*
+ * calls the pool trace hook with the current time
+ */
+void
+PQNB_pool_trace(struct PQNB_pool *pool, enum PQNB_trace_event event,
+                struct PQNB_query_request *req);
+#define PQNB_trace(pool, event, req) PQNB_pool_trace((pool), (event), (req))
+#else
+#define PQNB_trace(pool, event, req) ((void) 0)
+#endif
+
 #endif /* ~PQNB_INTERNAL_H */
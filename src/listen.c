@@ -0,0 +1,212 @@
+#include "pqnb.h"
+
+#include "internal.h"
+#include "listen.h"
+
+#include <libpq-fe.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * NAMEDATALEN - 1, the server truncates longer names
+ */
+#define PQNB_CHANNEL_MAX_LEN 63
+
+struct PQNB_channel
+{
+  struct PQNB_channel *next;
+  PQNB_notify_cb notify_cb;
+  void *user_data;
+  char name[];
+};
+
+/*
+ * LISTEN / UNLISTEN results, a failed one shows up
+ * as missing notifications
+ */
+static void
+PQNB_listen_ignore(PGresult *result, void *user_data,
+                   char *error_msg, bool timeout)
+{
+  (void) result;
+  (void) user_data;
+  (void) error_msg;
+  (void) timeout;
+}
+
+static struct PQNB_channel **
+PQNB_listen_find(struct PQNB_pool *pool, const char *channel)
+{
+  struct PQNB_channel **link = &pool->channels;
+
+  while (NULL != *link && 0 != strcmp((*link)->name, channel))
+    link = &(*link)->next;
+  return link;
+}
+
+/*
+ * sends the command with the channel as a quoted identifier.
+ * returns 0 on success, -1 on error
+ */
+static int
+PQNB_listen_send(struct PQNB_session *session, const char *command,
+                 const char *channel)
+{
+  /* quotes may all be doubled */
+  char sql[sizeof("UNLISTEN \"\"") + 2 * PQNB_CHANNEL_MAX_LEN];
+  const struct PQNB_query query = {
+    .query = sql,
+    .flags = PQNB_QUERY_COPY,
+  };
+  int len = snprintf(sql, sizeof(sql), "%s \"", command);
+
+  for (; '\0' != *channel; channel++)
+    {
+      if ('"' == *channel)
+        sql[len++] = '"';
+      sql[len++] = *channel;
+    }
+  sql[len++] = '"';
+  sql[len] = '\0';
+  return PQNB_session_query(session, &query, PQNB_listen_ignore, NULL);
+}
+
+void
+PQNB_listen_acquire(struct PQNB_pool *pool)
+{
+  struct PQNB_session *session;
+
+  if (NULL != pool->listener || NULL == pool->channels)
+    return;
+  /* tried again once a connection connects */
+  session = PQNB_pool_session(pool, 0, 0);
+  if (NULL == session)
+    return;
+  session->listener = 1;
+  pool->listener = session;
+  for (struct PQNB_channel *channel = pool->channels;
+       NULL != channel; channel = channel->next)
+    if (-1 == PQNB_listen_send(session, "LISTEN", channel->name))
+      {
+        /* a lost session was replaced already */
+        if (pool->listener == session)
+          {
+            pool->listener = NULL;
+            PQNB_session_end(session, false, NULL, NULL);
+          }
+        return;
+      }
+}
+
+void
+PQNB_listen_lost(struct PQNB_session *session)
+{
+  struct PQNB_pool *pool = session->pool;
+
+  if (pool->listener != session)
+    return;
+  /* freed by the caller, or once its connection is given back */
+  pool->listener = NULL;
+  session->ended = 1;
+  PQNB_listen_acquire(pool);
+}
+
+void
+PQNB_listen_dispatch(struct PQNB_pool *pool, struct PQNB_connection *conn)
+{
+  struct PQNB_channel *channel;
+  PGnotify *notify;
+
+  while (NULL != (notify = PQnotifies(conn->pg_conn)))
+    {
+      pool->stats.notifications++;
+      PQNB_pool_cache_invalidate(pool, notify->relname);
+      /* looked up each time, callbacks may unsubscribe */
+      channel = *PQNB_listen_find(pool, notify->relname);
+      if (NULL != channel && NULL != channel->notify_cb)
+        channel->notify_cb(pool, notify->relname, notify->extra,
+                           notify->be_pid, channel->user_data);
+      PQfreemem(notify);
+    }
+}
+
+void
+PQNB_listen_free_all(struct PQNB_pool *pool)
+{
+  struct PQNB_channel *channel;
+
+  while (NULL != (channel = pool->channels))
+    {
+      pool->channels = channel->next;
+      free(channel);
+    }
+  pool->listener = NULL;
+}
+
+int
+PQNB_pool_listen(struct PQNB_pool *pool, const char *channel,
+                 PQNB_notify_cb notify_cb, const void *user_data)
+{
+  struct PQNB_channel **link = PQNB_listen_find(pool, channel);
+  struct PQNB_session *session = pool->listener;
+  const size_t len = strlen(channel);
+  struct PQNB_channel *subscribed;
+
+  if (NULL != *link)
+    {
+      (*link)->notify_cb = notify_cb;
+      (*link)->user_data = (void*) user_data;
+      return 0;
+    }
+  if (0 == len || PQNB_CHANNEL_MAX_LEN < len)
+    return -1;
+  subscribed = malloc(sizeof(*subscribed) + len + 1);
+  if (NULL == subscribed)
+    return -1;
+  subscribed->next = NULL;
+  subscribed->notify_cb = notify_cb;
+  subscribed->user_data = (void*) user_data;
+  memcpy(subscribed->name, channel, len + 1);
+  *link = subscribed;
+
+  if (NULL == session)
+    {
+      PQNB_listen_acquire(pool);
+      return 0;
+    }
+  /* a lost session is replaced by one listening to every channel */
+  if (-1 == PQNB_listen_send(session, "LISTEN", channel)
+      && pool->listener == session)
+    {
+      *link = NULL;
+      free(subscribed);
+      return -1;
+    }
+  return 0;
+}
+
+int
+PQNB_pool_unlisten(struct PQNB_pool *pool, const char *channel)
+{
+  struct PQNB_channel **link = PQNB_listen_find(pool, channel);
+  struct PQNB_channel *subscribed = *link;
+  struct PQNB_session *session = pool->listener;
+
+  if (NULL == subscribed)
+    return -1;
+  *link = subscribed->next;
+  if (NULL != session && NULL == pool->channels)
+    {
+      /* reset when given back, it doesn't listen anymore */
+      pool->listener = NULL;
+      PQNB_session_end(session, false, NULL, NULL);
+    }
+  else if (NULL != session)
+    /* failing, notifications are only left unclaimed */
+    PQNB_listen_send(session, "UNLISTEN", subscribed->name);
+  free(subscribed);
+  return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef PQNB_LISTEN_H
+#define PQNB_LISTEN_H
+
+#include "internal.h"
+
+/*
+ * starts acquiring a listener session if channels are subscribed
+ * and there is none, its connection LISTENs to all of them
+ */
+void
+PQNB_listen_acquire(struct PQNB_pool *pool);
+
+/*
+ * the listener session failed, it ends and another
+ * one is acquired to listen again
+ */
+void
+PQNB_listen_lost(struct PQNB_session *session);
+
+/*
+ * passes the notifications read on the connection to the
+ * channel callbacks, invalidating the cached results first
+ */
+void
+PQNB_listen_dispatch(struct PQNB_pool *pool, struct PQNB_connection *conn);
+
+/*
+ * PQNB_pool_free only, after the sessions
+ */
+void
+PQNB_listen_free_all(struct PQNB_pool *pool);
+
+#endif /* ~PQNB_LISTEN_H */
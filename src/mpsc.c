@@ -0,0 +1,83 @@
+#include "mpsc.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+struct PQNB_mpsc
+{
+  /*
+   * last pushed node, producers swap it
+   */
+  _Atomic(struct PQNB_mpsc_node *) head;
+  /*
+   * next node to pop, consumer owned
+   */
+  struct PQNB_mpsc_node *tail;
+  /*
+   * keeps the list non empty
+   */
+  struct PQNB_mpsc_node stub;
+};
+
+struct PQNB_mpsc *
+PQNB_mpsc_init(void)
+{
+  struct PQNB_mpsc *queue = malloc(sizeof(*queue));
+  if (NULL == queue)
+    return NULL;
+  atomic_init(&queue->stub.next, NULL);
+  atomic_init(&queue->head, &queue->stub);
+  queue->tail = &queue->stub;
+  return queue;
+}
+
+void
+PQNB_mpsc_free(struct PQNB_mpsc *queue)
+{
+  free(queue);
+}
+
+void
+PQNB_mpsc_push(struct PQNB_mpsc *queue, struct PQNB_mpsc_node *node)
+{
+  struct PQNB_mpsc_node *prev;
+
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+  /* the node is unreachable by the consumer until linked here */
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+struct PQNB_mpsc_node *
+PQNB_mpsc_pop(struct PQNB_mpsc *queue)
+{
+  struct PQNB_mpsc_node *tail = queue->tail;
+  struct PQNB_mpsc_node *next
+    = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  if (&queue->stub == tail)
+    {
+      if (NULL == next)
+        return NULL;
+      queue->tail = next;
+      tail = next;
+      next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+  if (NULL != next)
+    {
+      queue->tail = next;
+      return tail;
+    }
+  if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+    return NULL;
+  /* tail is the last node, the stub goes behind it so it can be taken */
+  PQNB_mpsc_push(queue, &queue->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (NULL != next)
+    {
+      queue->tail = next;
+      return tail;
+    }
+  return NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef PQNB_MPSC_H
+#define PQNB_MPSC_H
+
+#include <stdatomic.h>
+
+/*
+ * embedded in whatever is queued
+ */
+struct PQNB_mpsc_node
+{
+  _Atomic(struct PQNB_mpsc_node *) next;
+};
+
+/*
+ * lock-free multi-producer single-consumer intrusive queue
+ */
+struct PQNB_mpsc;
+
+struct PQNB_mpsc *
+PQNB_mpsc_init(void);
+
+/*
+ * queued nodes aren't freed
+ */
+void
+PQNB_mpsc_free(struct PQNB_mpsc *queue);
+
+/*
+ * safe from any thread
+ */
+void
+PQNB_mpsc_push(struct PQNB_mpsc *queue, struct PQNB_mpsc_node *node);
+
+/*
+ * consumer only. oldest node, NULL if empty or if a producer
+ * is halfway through pushing the next one
+ */
+struct PQNB_mpsc_node *
+PQNB_mpsc_pop(struct PQNB_mpsc *queue);
+
+#endif /* ~PQNB_MPSC_H */
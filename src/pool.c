@@ -3,31 +3,122 @@
 #include "internal.h"
 #include "connection.h"
 #include "ring_buffer.h"
+#include "copy.h"
+#include "group.h"
+#include "session.h"
+#include "listen.h"
 
 #include <libpq-fe.h>
 
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
+
+/*
+ * opens one more connection to the host.
+ * returns 0 on success, -1 on error
+ */
+static int
+PQNB_pool_open(struct PQNB_pool *pool, struct PQNB_host *host)
+{
+  struct PQNB_connection *conn;
+
+  if (UINT16_MAX == pool->num_connections
+      || -1 == PQNB_timer_reserve(pool->conn_timers,
+                                  pool->num_connections + 1))
+    return -1;
+  conn = PQNB_connection_init(pool, host, host->conninfo);
+  if (NULL == conn)
+    return -1;
+  if (-1 == PQNB_connection_begin_polling(conn))
+    {
+      PQNB_connection_free(conn);
+      return -1;
+    }
+  return 0;
+}
+
+static void
+PQNB_pool_free_hosts(struct PQNB_pool *pool)
+{
+  for (int h = 0; h < pool->num_hosts; h++)
+    {
+      struct PQNB_host *host = &pool->hosts[h];
+      while (NULL != host->conns_head)
+        PQNB_connection_free(host->conns_head);
+      free(host->conninfo);
+    }
+  free(pool->hosts);
+}
 
 struct PQNB_pool *
 PQNB_pool_init(const char *conninfo, uint16_t num_connections)
 {
+  return PQNB_pool_init_hosts(conninfo, NULL, 0, num_connections);
+}
+
+struct PQNB_pool *
+PQNB_pool_init_hosts(const char *primary, const char *const *replicas,
+                     uint16_t num_replicas, uint16_t num_connections)
+{
+  struct epoll_event event;
+  const uint32_t total = (uint32_t) (1 + num_replicas) * num_connections;
+
+  if (UINT16_MAX < total)
+    return NULL;
+
   struct PQNB_pool *pool = calloc(1, sizeof(*pool));
   if (NULL == pool)
     return NULL;
 
-  pool->connect_timeout = PQNB_DEFAULT_CONNECT_TIMEOUT;
-  pool->query_timeout = PQNB_DEFAULT_QUERY_TIMEOUT;
+  pool->epoll_fd = -1;
+  pool->timer_fd = -1;
+  pool->event_fd = -1;
+  pool->connect_timeout = PQNB_DEFAULT_CONNECT_TIMEOUT * PQNB_NSEC_PER_SEC;
+  pool->query_timeout = PQNB_DEFAULT_QUERY_TIMEOUT * PQNB_NSEC_PER_SEC;
+  pool->pipeline_depth = 1;
+  pool->queue_capacity = PQNB_MAX_QBUF;
+  pool->min_connections = num_connections;
+  pool->max_connections = num_connections;
+  pool->backoff_min = PQNB_DEFAULT_RECONNECT_BACKOFF_MS * PQNB_NSEC_PER_MSEC;
+  pool->backoff_max = PQNB_DEFAULT_RECONNECT_BACKOFF_MAX_MS
+                      * PQNB_NSEC_PER_MSEC;
+  pool->max_reconnects = PQNB_DEFAULT_MAX_RECONNECTS;
+  if (-1 == PQNB_timer_now(&pool->now))
+    goto cleanup;
+  pool->rng = pool->now | 1;
+
+  for (int i = 0; i < PQNB_MAX_QUERY_CLASSES; i++)
+    {
+      struct PQNB_query_class *qc = &pool->classes[i];
+      qc->queue = PQNB_ring_buffer_init(PQNB_QBUF_INITIAL,
+                                        sizeof(struct PQNB_query_request));
+      if (NULL == qc->queue)
+        goto cleanup;
+      qc->weight = 1;
+    }
+  pool->classes[0].deficit = pool->classes[0].weight;
 
-  pool->queries_buffer = PQNB_ring_buffer_init(PQNB_MAX_QBUF, 
-                                               sizeof(struct PQNB_query_request));
-  if (NULL == pool->queries_buffer)
+  /*
+   * sized so arming never allocates, each connection
+   * and queued request has a single timer. The queue one
+   * grows along with the queries buffer
+   */
+  pool->conn_timers = PQNB_timer_heap_init(total);
+  if (NULL == pool->conn_timers)
+    goto cleanup;
+  pool->queue_timers = PQNB_timer_heap_init(PQNB_QBUF_INITIAL);
+  if (NULL == pool->queue_timers)
     goto cleanup;
 
   int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
@@ -35,32 +126,69 @@ PQNB_pool_init(const char *conninfo, uint16_t num_connections)
     goto cleanup;
   pool->epoll_fd = epoll_fd;
 
-  pool->connections = calloc(num_connections, sizeof(*pool->connections));
-  if (NULL == pool->connections)
+  pool->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                  TFD_NONBLOCK | TFD_CLOEXEC);
+  if (-1 == pool->timer_fd)
+    goto cleanup;
+  event.events = EPOLLIN;
+  event.data.ptr = &pool->timer_fd;
+  if (-1 == epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD,
+                      pool->timer_fd, &event))
+    goto cleanup;
+
+  pool->posted = PQNB_mpsc_init();
+  if (NULL == pool->posted)
+    goto cleanup;
+  pool->arena = PQNB_slab_init();
+  if (NULL == pool->arena)
+    goto cleanup;
+  atomic_init(&pool->wakeup_pending, false);
+  pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (-1 == pool->event_fd)
+    goto cleanup;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = &pool->event_fd;
+  if (-1 == epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD,
+                      pool->event_fd, &event))
+    goto cleanup;
+
+  pool->hosts = calloc(1 + num_replicas, sizeof(*pool->hosts));
+  if (NULL == pool->hosts)
     goto cleanup;
+  pool->num_hosts = 1 + num_replicas;
 
-  for (int i = 0; i < num_connections; i++)
+  for (int h = 0; h < pool->num_hosts; h++)
     {
-      struct PQNB_connection *conn = PQNB_connection_init(pool, conninfo);
-      if (NULL == conn)
-        goto cleanup;
-      pool->connections[i] = conn;
-      pool->num_connections++;
-      if (-1 == PQNB_connection_begin_polling(conn))
+      struct PQNB_host *host = &pool->hosts[h];
+      host->conninfo = strdup(0 == h ? primary : replicas[h - 1]);
+      if (NULL == host->conninfo)
         goto cleanup;
+      for (int i = 0; i < num_connections; i++)
+        if (-1 == PQNB_pool_open(pool, host))
+          goto cleanup;
     }
 
   return pool;
 cleanup:
-  if (0 < pool->num_connections)
-    {
-      for (int j = pool->num_connections; j >= 0; --j)
-        PQNB_connection_free(pool->connections[j]);
-    }
-  if (NULL != pool->queries_buffer)
-    PQNB_ring_buffer_free(pool->queries_buffer);
-  if (NULL != pool->connections)
-    free(pool->connections);
+  if (NULL != pool->hosts)
+    PQNB_pool_free_hosts(pool);
+  if (-1 != pool->event_fd)
+    close(pool->event_fd);
+  if (NULL != pool->arena)
+    PQNB_slab_free(pool->arena);
+  if (NULL != pool->posted)
+    PQNB_mpsc_free(pool->posted);
+  if (-1 != pool->timer_fd)
+    close(pool->timer_fd);
+  if (-1 != pool->epoll_fd)
+    close(pool->epoll_fd);
+  if (NULL != pool->queue_timers)
+    PQNB_timer_heap_free(pool->queue_timers);
+  if (NULL != pool->conn_timers)
+    PQNB_timer_heap_free(pool->conn_timers);
+  for (int i = 0; i < PQNB_MAX_QUERY_CLASSES; i++)
+    if (NULL != pool->classes[i].queue)
+      PQNB_ring_buffer_free(pool->classes[i].queue);
   free(pool);
   return NULL;
 }
@@ -68,28 +196,970 @@ cleanup:
 void
 PQNB_pool_free(struct PQNB_pool *pool)
 {
-  for (int i = 0; i < pool->num_connections; i++)
-    PQNB_connection_free(pool->connections[i]);
-  PQNB_ring_buffer_free(pool->queries_buffer);
-  free(pool->connections);
+  struct PQNB_mpsc_node *node;
+
+  PQNB_pool_free_hosts(pool);
+  PQNB_session_free_all(pool);
+  PQNB_listen_free_all(pool);
+  /* posted queries are dropped like the queued ones */
+  while (NULL != (node = PQNB_mpsc_pop(pool->posted)))
+    free(PQNB_container_of(node, struct PQNB_query_post, node));
+  PQNB_mpsc_free(pool->posted);
+  /* with the blocks of the queued requests */
+  PQNB_slab_free(pool->arena);
+  if (NULL != pool->result_cache)
+    PQNB_result_cache_free(pool->result_cache);
+  if (NULL != pool->flights)
+    PQNB_flights_free(pool->flights);
+  close(pool->event_fd);
+  close(pool->timer_fd);
+  close(pool->epoll_fd);
+  PQNB_timer_heap_free(pool->queue_timers);
+  PQNB_timer_heap_free(pool->conn_timers);
+  for (int i = 0; i < PQNB_MAX_QUERY_CLASSES; i++)
+    PQNB_ring_buffer_free(pool->classes[i].queue);
   free(pool);
 }
 
+/*
+ * answers the query from the result cache.
+ * returns true if it was cached
+ */
+static bool
+PQNB_pool_cached(struct PQNB_pool *pool, const struct PQNB_query *query,
+                 PQNB_query_cb query_cb, const void *user_data)
+{
+  struct PQNB_result_entry *entry;
+
+  if (NULL == pool->result_cache
+      || PQNB_QUERY_CACHE != ((PQNB_QUERY_CACHE | PQNB_QUERY_STREAM)
+                              & query->flags)
+      || -1 == PQNB_timer_now(&pool->now))
+    return false;
+  entry = PQNB_result_cache_get(pool->result_cache, query, pool->now);
+  if (NULL == entry)
+    {
+      pool->stats.cache_misses++;
+      return false;
+    }
+  pool->stats.cache_hits++;
+  /* the callback may invalidate it, it is freed once released */
+  query_cb(entry->result, (void*) user_data, NULL, false);
+  PQNB_result_cache_release(entry);
+  return true;
+}
+
+/*
+ * attaches the callback to the request of the same
+ * PQNB_QUERY_SINGLE_FLIGHT query and params, if one is queued
+ * or in flight. returns true if it was attached
+ */
+static bool
+PQNB_pool_joined(struct PQNB_pool *pool, const struct PQNB_query *query,
+                 PQNB_query_cb query_cb, const void *user_data)
+{
+  if (NULL == pool->flights
+      || PQNB_QUERY_SINGLE_FLIGHT != ((PQNB_QUERY_SINGLE_FLIGHT
+                                       | PQNB_QUERY_STREAM) & query->flags)
+      || !PQNB_flight_join(pool->flights, query, query_cb, user_data))
+    return false;
+  pool->stats.coalesced++;
+  return true;
+}
+
+/*
+ * identical queries are attached to the request until its first
+ * result. It runs on its own on allocation errors
+ */
+static void
+PQNB_pool_fly(struct PQNB_pool *pool, struct PQNB_query_request *req,
+              const struct PQNB_query *query)
+{
+  struct PQNB_flight *flight;
+
+  if (PQNB_QUERY_SINGLE_FLIGHT != ((PQNB_QUERY_SINGLE_FLIGHT
+                                    | PQNB_QUERY_STREAM) & query->flags))
+    return;
+  if (NULL == pool->flights
+      && NULL == (pool->flights = PQNB_flights_init()))
+    return;
+  flight = PQNB_flight_start(pool->flights, query,
+                             req->query_cb, req->user_data);
+  if (NULL == flight)
+    return;
+  req->flight = flight;
+  req->query_cb = PQNB_flight_notify;
+  req->user_data = flight;
+}
+
+/*
+ * hands the request first result over to the result cache, only
+ * successful ones are kept. Called before the callback, the query
+ * and params may be freed from it. returns the entry to release
+ * once the result is delivered, NULL if the result wasn't cached
+ */
+static struct PQNB_result_entry *
+PQNB_pool_cache_put(struct PQNB_pool *pool, struct PQNB_query_request *req,
+                    PGresult *result)
+{
+  const struct PQNB_query query = {
+    .query = req->query,
+    .param_types = req->param_types,
+    .param_values = req->param_values,
+    .param_lengths = req->param_lengths,
+    .param_formats = req->param_formats,
+    .num_params = req->num_params,
+    .result_format = req->result_format,
+  };
+
+  req->cache = 0;
+  if (NULL == pool->result_cache
+      || PGRES_TUPLES_OK != PQresultStatus(result))
+    return NULL;
+  return PQNB_result_cache_put(pool->result_cache, &query,
+                               req->cache_channel, result,
+                               0 < pool->cache_ttl
+                               ? pool->now + pool->cache_ttl : 0);
+}
+
+/*
+ * passes every available result to the in-flight requests,
+ * in the order they were sent
+ */
+static void
+PQNB_pool_deliver(struct PQNB_pool *pool, struct PQNB_connection *conn)
+{
+  struct PQNB_result_entry *entry;
+  struct PQNB_query_request *req;
+  PGresult *result;
+
+  while (NULL != (req = PQNB_ring_buffer_tail(conn->requests)))
+    {
+      if (CONN_COPY_OUT == conn->action)
+        {
+          const int res = PQNB_copy_drain(conn, req);
+          if (-1 == res)
+            PQNB_connection_fail(conn, PQerrorMessage(conn->pg_conn),
+                                 false);
+          if (0 == res && CONN_COPY_OUT == conn->action
+              && PQNB_connection_pending(conn))
+            {
+              if (-1 == PQNB_connection_read(conn))
+                {
+                  PQNB_connection_fail(conn,
+                      PQerrorMessage(conn->pg_conn), false);
+                  return;
+                }
+              continue;
+            }
+          if (1 != res)
+            return;
+          /* the final result follows */
+          conn->action = CONN_QUERYING;
+        }
+      /*
+       * must be set before libpq parses any of the query rows,
+       * PQisBusy does it
+       */
+      if (0 < req->stream_rows && 0 == req->streaming
+          && 0 == req->deallocating && 0 == req->preparing)
+        {
+          PQNB_connection_stream(conn, req);
+          req->streaming = 1;
+        }
+      if (0 != PQisBusy(conn->pg_conn))
+        {
+          if (!PQNB_connection_pending(conn))
+            break;
+          if (-1 == PQNB_connection_read(conn))
+            {
+              PQNB_connection_fail(conn, PQerrorMessage(conn->pg_conn),
+                                   false);
+              return;
+            }
+          continue;
+        }
+      result = PQgetResult(conn->pg_conn);
+      if (NULL != result && 0 == req->responded)
+        {
+          req->responded = 1;
+          PQNB_histogram_record(&pool->stats.first_result,
+                                pool->now - req->sent_at);
+#ifdef PQNB_TRACE
+          /* read along with the previous pipelined request */
+          if (0 == req->first_read)
+            {
+              req->first_read = 1;
+              PQNB_trace(pool, PQNB_TRACE_FIRST_READ, req);
+            }
+#endif
+        }
+      if (conn->pipelined)
+        {
+          /*
+           * every query is followed by a sync, each command results
+           * ends with NULL and the query with PGRES_PIPELINE_SYNC
+           */
+          if (req->deallocating)
+            {
+              /* the evicted statement is gone either way */
+              if (NULL != result
+                  && PGRES_PIPELINE_SYNC == PQresultStatus(result))
+                req->deallocating = 0;
+              PQclear(result);
+              continue;
+            }
+          if (NULL == result)
+            {
+              req->preparing = 0;
+              continue;
+            }
+          const ExecStatusType status = PQresultStatus(result);
+          if (PGRES_PIPELINE_SYNC == status
+              || (req->prepare_failed
+                  && PGRES_PIPELINE_ABORTED == status))
+            {
+              PQclear(result);
+              if (PGRES_PIPELINE_SYNC == status)
+                PQNB_connection_pop(conn, true);
+              continue;
+            }
+          if (req->preparing)
+            {
+              /* followers execute it from now on */
+              PQNB_stmt_cache_prepared(conn->stmt_cache, req->query,
+                                       req->num_params, req->param_types,
+                                       req->stmt_id,
+                                       PGRES_COMMAND_OK == status);
+              if (PGRES_COMMAND_OK == status)
+                {
+                  PQclear(result);
+                  continue;
+                }
+              /*
+               * the statement isn't on the server, the error
+               * is passed to the callback
+               */
+              req->prepare_failed = 1;
+            }
+        }
+      else if (NULL == result)
+        {
+          PQNB_connection_pop(conn, true);
+          continue;
+        }
+      else if (NULL != req->copy_cb
+               && (PGRES_COPY_IN == PQresultStatus(result)
+                   || PGRES_COPY_OUT == PQresultStatus(result)))
+        {
+          if (PGRES_COPY_IN == PQresultStatus(result))
+            {
+              PQclear(result);
+              conn->action = CONN_COPY_IN;
+              req->copy_cb((struct PQNB_copy *) conn,
+                           PQNB_COPY_WRITABLE, NULL, 0,
+                           req->user_data);
+              /* PQNB_copy_end may have been called already */
+              if (CONN_QUERYING != conn->action)
+                return;
+            }
+          else
+            {
+              PQclear(result);
+              conn->action = CONN_COPY_OUT;
+            }
+          continue;
+        }
+      entry = req->cache ? PQNB_pool_cache_put(pool, req, result) : NULL;
+      if (0 == req->cancelled)
+        req->query_cb(result, req->user_data, NULL, false);
+      /* the callback may have invalidated it, or disabled the cache */
+      if (NULL != entry)
+        PQNB_result_cache_release(entry);
+      else
+        PQclear(result);
+      /* the callback may have failed this connection */
+      if (CONN_QUERYING != conn->action
+          && CONN_FLUSHING != conn->action
+          && CONN_CANCELLING != conn->action)
+        return;
+    }
+
+  /*
+   * a cancel request still in flight could
+   * hit the next query
+   */
+  if (PQNB_ring_buffer_empty(conn->requests)
+      && (CONN_QUERYING == conn->action
+          || (CONN_CANCELLING == conn->action
+              && !PQNB_connection_cancelling(conn))))
+    {
+      PQNB_querying_remove(pool->querying_head,
+                           pool->querying_tail,
+                           conn);
+      PQNB_connection_idle(conn);
+    }
+  if (NULL != conn->session)
+    PQNB_session_resume(conn->session);
+  PQNB_connection_schedule(conn);
+}
+
+/*
+ * signals crossing the watermarks, once per crossing
+ */
+static void
+PQNB_pool_watermark(struct PQNB_pool *pool)
+{
+  if (NULL == pool->watermark_cb)
+    return;
+  if (!pool->above_watermark && pool->queued >= pool->high_watermark)
+    {
+      pool->above_watermark = true;
+      pool->watermark_cb(pool, true, pool->queued, pool->watermark_data);
+    }
+  else if (pool->above_watermark && pool->queued <= pool->low_watermark)
+    {
+      pool->above_watermark = false;
+      pool->watermark_cb(pool, false, pool->queued, pool->watermark_data);
+    }
+}
+
+/*
+ * copies the request to its class queue, growing it if
+ * there's room left. returns 0 on success, PQNB_QUEUE_FULL
+ * or -1 on allocation errors
+ */
+static int
+PQNB_pool_enqueue(struct PQNB_pool *pool, struct PQNB_query_request *req)
+{
+  struct PQNB_query_class *qc = &pool->classes[req->query_class];
+  struct PQNB_ring_buffer *rb = qc->queue;
+  struct PQNB_query_request *queued;
+  size_t count = PQNB_ring_buffer_count(rb);
+  size_t total = 0;
+
+  /* timed out requests still hold their entry until popped */
+  for (int i = 0; i < PQNB_MAX_QUERY_CLASSES; i++)
+    total += PQNB_ring_buffer_count(pool->classes[i].queue);
+  if (total >= pool->queue_capacity)
+    return PQNB_QUEUE_FULL;
+
+  if (-1 == PQNB_timer_reserve(pool->queue_timers, total + 1))
+    return -1;
+  if (count == PQNB_ring_buffer_capacity(rb))
+    {
+      if (-1 == PQNB_ring_buffer_grow(rb))
+        return -1;
+      /* queued requests moved, their armed timers follow */
+      for (size_t i = 0; i < count; i++)
+        {
+          queued = PQNB_ring_buffer_at(rb, i);
+          PQNB_timer_moved(pool->queue_timers, &queued->timer);
+        }
+    }
+
+  PQNB_ring_buffer_push(rb, req);
+  queued = PQNB_ring_buffer_last(rb);
+  PQNB_timer_arm(pool->queue_timers, &queued->timer,
+                 queued->timer.deadline);
+  pool->queued++;
+  qc->stats.queued++;
+  PQNB_trace(pool, PQNB_TRACE_ENQUEUED, queued);
+  return 0;
+}
+
+/*
+ * deficit round robin, the class whose oldest request goes
+ * next, NULL if every queue is empty. Requests cost 1
+ */
+static struct PQNB_query_class *
+PQNB_pool_next_class(struct PQNB_pool *pool)
+{
+  struct PQNB_query_class *qc;
+  struct PQNB_query_request *req;
+
+  /* a non empty class is reached within a round */
+  for (int i = 0; i <= PQNB_MAX_QUERY_CLASSES; i++)
+    {
+      qc = &pool->classes[pool->current_class];
+      /* timed out while queued, already notified */
+      while (NULL != (req = PQNB_ring_buffer_tail(qc->queue))
+             && req->cancelled)
+        PQNB_ring_buffer_pop(qc->queue);
+      if (NULL != req && 0 < qc->deficit)
+        return qc;
+      qc->deficit = 0;
+      pool->current_class = (pool->current_class + 1)
+                            % PQNB_MAX_QUERY_CLASSES;
+      qc = &pool->classes[pool->current_class];
+      qc->deficit = qc->weight;
+    }
+  return NULL;
+}
+
+/*
+ * accounts a request leaving its queue
+ */
+static void
+PQNB_pool_dispatched(struct PQNB_pool *pool, struct PQNB_query_request *req)
+{
+  struct PQNB_class_stats *stats = &pool->classes[req->query_class].stats;
+  const uint64_t wait = pool->now - req->enqueued_at;
+
+  stats->dispatched++;
+  stats->wait_total_ns += wait;
+  if (wait > stats->wait_max_ns)
+    stats->wait_max_ns = wait;
+  PQNB_histogram_record(&pool->stats.queue_wait, wait);
+}
+
+void
+PQNB_pool_fill(struct PQNB_pool *pool, struct PQNB_connection *conn)
+{
+  const bool batch = 1 < pool->batch_size;
+  struct PQNB_query_class *qc;
+  struct PQNB_query_request *req;
+  uint16_t batched = 0;
+
+  if (PQNB_idle_listed(conn->host->idle_head, conn))
+    PQNB_idle_remove(conn->host->idle_head, conn->host->idle_tail, conn);
+
+  while (NULL != (qc = PQNB_pool_next_class(pool)))
+    {
+      req = PQNB_ring_buffer_tail(qc->queue);
+      if (!PQNB_connection_accepts(conn, req)
+          && !(batch && PQNB_connection_batches(conn, req)))
+        break;
+      PQNB_ring_buffer_pop(qc->queue);
+      PQNB_timer_disarm(pool->queue_timers, &req->timer);
+      qc->deficit--;
+      qc->stats.queued--;
+      pool->queued--;
+      PQNB_pool_dispatched(pool, req);
+      if (NULL != req->session)
+        PQNB_session_pin(conn, req);
+      else if (batch && NULL == req->copy_cb)
+        {
+          /* flushed all at once */
+          if (-1 == PQNB_connection_send(conn, req))
+            break;
+          batched++;
+        }
+      else
+        PQNB_connection_query(conn, req);
+    }
+  if (0 < batched && CONN_FLUSHING == conn->action)
+    {
+      if (1 < batched)
+        pool->stats.batches++;
+      PQNB_connection_flush(conn);
+    }
+
+  /* a session ended before acquiring it fills it on its own */
+  if (PQNB_connection_has_slot(conn)
+      && !PQNB_idle_listed(conn->host->idle_head, conn))
+    PQNB_idle_push(conn->host->idle_head, conn->host->idle_tail, conn);
+  PQNB_pool_watermark(pool);
+}
+
+/*
+ * wakes the host loop through timer_fd at the earliest deadline
+ */
+static void
+PQNB_pool_arm(struct PQNB_pool *pool)
+{
+  struct PQNB_timer *conn_timer, *queue_timer;
+  struct itimerspec its = {0};
+  uint64_t deadline = UINT64_MAX;
+
+  conn_timer = PQNB_timer_top(pool->conn_timers);
+  queue_timer = PQNB_timer_top(pool->queue_timers);
+  if (NULL != conn_timer)
+    deadline = conn_timer->deadline;
+  if (NULL != queue_timer && queue_timer->deadline < deadline)
+    deadline = queue_timer->deadline;
+
+  /*
+   * an earlier pending deadline only wakes us up for nothing,
+   * re-arming on every completion would cost a syscall per query
+   */
+  if (UINT64_MAX == deadline
+      || (pool->now < pool->timer_armed
+          && pool->timer_armed <= deadline))
+    return;
+
+  its.it_value.tv_sec = deadline / PQNB_NSEC_PER_SEC;
+  its.it_value.tv_nsec = deadline % PQNB_NSEC_PER_SEC;
+  if (0 == timerfd_settime(pool->timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+    pool->timer_armed = deadline;
+}
+
+/*
+ * notifies the requests whose deadline passed
+ */
+static void
+PQNB_pool_expire(struct PQNB_pool *pool)
+{
+  struct PQNB_timer *timer;
+  struct PQNB_query_request *req;
+
+  /*
+   * expiring moves the connection timer past now
+   */
+  while (NULL != (timer = PQNB_timer_top(pool->conn_timers))
+         && timer->deadline <= pool->now)
+    PQNB_connection_expire(PQNB_container_of(timer,
+                                             struct PQNB_connection,
+                                             timer));
+
+  /*
+   * queued requests can't be taken out of the middle of the
+   * queue, they are skipped once they reach the tail
+   */
+  while (NULL != (timer = PQNB_timer_top(pool->queue_timers))
+         && timer->deadline <= pool->now)
+    {
+      req = PQNB_container_of(timer, struct PQNB_query_request, timer);
+      PQNB_timer_disarm(pool->queue_timers, timer);
+      req->cancelled = 1;
+      PQNB_pool_release(pool, req);
+      pool->queued--;
+      pool->classes[req->query_class].stats.queued--;
+      pool->classes[req->query_class].stats.expired++;
+      pool->stats.timeouts++;
+      req->query_cb(NULL, req->user_data, NULL, true);
+    }
+  for (int i = 0; i < PQNB_MAX_QUERY_CLASSES; i++)
+    {
+      struct PQNB_ring_buffer *queue = pool->classes[i].queue;
+      while (NULL != (req = PQNB_ring_buffer_tail(queue))
+             && req->cancelled)
+        PQNB_ring_buffer_pop(queue);
+    }
+  PQNB_pool_watermark(pool);
+}
+
+/*
+ * if a replica is in rotation
+ */
+static bool
+PQNB_pool_replica_up(struct PQNB_pool *pool)
+{
+  for (int h = 1; h < pool->num_hosts; h++)
+    if (!PQNB_host_down(&pool->hosts[h]))
+      return true;
+  return false;
+}
+
+/*
+ * circuit breaker, fails the queued requests once the primary
+ * goes down, read-only ones stay while a replica is up. New
+ * requests fail on submission until the primary connects again
+ */
+static void
+PQNB_pool_breaker(struct PQNB_pool *pool)
+{
+  const bool open = PQNB_host_down(&pool->hosts[0]);
+  const bool replica_up = PQNB_pool_replica_up(pool);
+  struct PQNB_query_request *req;
+
+  if (!open || pool->breaker_open)
+    {
+      pool->breaker_open = open;
+      return;
+    }
+  pool->breaker_open = true;
+
+  for (int i = 0; i < PQNB_MAX_QUERY_CLASSES; i++)
+    {
+      struct PQNB_query_class *qc = &pool->classes[i];
+      /* callbacks may submit, rejected while the breaker is open */
+      for (size_t j = 0; j < PQNB_ring_buffer_count(qc->queue); j++)
+        {
+          req = PQNB_ring_buffer_at(qc->queue, j);
+          if (req->cancelled || (req->read_only && replica_up))
+            continue;
+          PQNB_timer_disarm(pool->queue_timers, &req->timer);
+          req->cancelled = 1;
+          PQNB_pool_release(pool, req);
+          qc->stats.queued--;
+          pool->queued--;
+          pool->stats.errors++;
+          req->query_cb(NULL, req->user_data,
+                        "Database unavailable\n", false);
+        }
+      while (NULL != (req = PQNB_ring_buffer_tail(qc->queue))
+             && req->cancelled)
+        PQNB_ring_buffer_pop(qc->queue);
+    }
+  PQNB_pool_watermark(pool);
+}
+
+/*
+ * opens one more connection for a queued request while queued
+ * requests exceed the threshold plus the connections being opened
+ */
+static void
+PQNB_pool_grow(struct PQNB_pool *pool, struct PQNB_query_request *req)
+{
+  struct PQNB_host *host = &pool->hosts[0];
+  struct PQNB_connection *conn;
+  uint32_t opening = 0;
+
+  if (req->read_only)
+    for (int h = 1; h < pool->num_hosts; h++)
+      if (!PQNB_host_down(&pool->hosts[h])
+          && pool->hosts[h].num_connections < pool->max_connections)
+        {
+          host = &pool->hosts[h];
+          break;
+        }
+  if (host->num_connections >= pool->max_connections)
+    return;
+  for (conn = pool->connecting_head; NULL != conn;
+       conn = conn->next_connecting)
+    if (host == conn->host && CONN_CONNECTING == conn->action)
+      opening++;
+  if (pool->queued > pool->grow_threshold + opening)
+    PQNB_pool_open(pool, host);
+}
+
+/*
+ * first listed connection of the host taking the request
+ */
+static struct PQNB_connection *
+PQNB_pool_pick(struct PQNB_host *host, struct PQNB_query_request *req)
+{
+  struct PQNB_connection *conn, *next;
+
+  for (conn = host->idle_head; NULL != conn; conn = next)
+    {
+      next = conn->next_idle;
+      /*
+       * listed connections may run out of slots if
+       * the pipeline depth was lowered
+       */
+      if (!PQNB_connection_has_slot(conn))
+        PQNB_idle_remove(host->idle_head, host->idle_tail, conn);
+      else if (PQNB_connection_accepts(conn, req))
+        return conn;
+    }
+  return NULL;
+}
+
+/*
+ * replica with the lowest expected wait, latency times
+ * in-flight queries, NULL if none is available
+ */
+static struct PQNB_connection *
+PQNB_pool_pick_replica(struct PQNB_pool *pool,
+                       struct PQNB_query_request *req)
+{
+  struct PQNB_connection *conn, *best = NULL;
+  uint64_t score, best_score = UINT64_MAX;
+
+  for (int h = 1; h < pool->num_hosts; h++)
+    {
+      struct PQNB_host *host = &pool->hosts[h];
+      if (NULL == host->idle_head || PQNB_host_down(host))
+        continue;
+      score = (host->latency + 1) * (host->in_flight + 1);
+      if (score >= best_score)
+        continue;
+      if (NULL != (conn = PQNB_pool_pick(host, req)))
+        {
+          best = conn;
+          best_score = score;
+        }
+    }
+  return best;
+}
+
+/*
+ * sends the request on the first listed connection taking it,
+ * read-only ones going to the best replica, queues it otherwise.
+ * pool->now and enqueued_at must be set. Posted requests get
+ * queueing errors through their callback. Takes the request
+ * arena block whatever happens
+ */
+static int
+PQNB_pool_dispatch(struct PQNB_pool *pool, struct PQNB_query_request *req,
+                   uint32_t timeout_ms, bool posted)
+{
+  struct PQNB_connection *conn = NULL;
+  int res;
+
+  req->timer.index = PQNB_TIMER_DISARMED;
+  req->timer.deadline = req->enqueued_at
+    + (0 < timeout_ms ? timeout_ms * PQNB_NSEC_PER_MSEC
+                      : pool->query_timeout);
+
+  if (req->read_only)
+    conn = PQNB_pool_pick_replica(pool, req);
+  if (NULL == conn)
+    conn = PQNB_pool_pick(&pool->hosts[0], req);
+  pool->stats.submitted++;
+
+  /* failing fast instead of queueing until the timeout */
+  if (NULL == conn && PQNB_host_down(&pool->hosts[0])
+      && !(req->read_only && PQNB_pool_replica_up(pool)))
+    {
+      pool->stats.unavailable++;
+      PQNB_pool_release(pool, req);
+      if (posted)
+        req->query_cb(NULL, req->user_data,
+                      "Database unavailable\n", false);
+      return PQNB_UNAVAILABLE;
+    }
+
+  if (NULL == conn)
+    {
+      res = PQNB_pool_enqueue(pool, req);
+      if (0 != res)
+        {
+          if (PQNB_QUEUE_FULL == res)
+            pool->stats.rejected++;
+          PQNB_pool_release(pool, req);
+          if (posted)
+            req->query_cb(NULL, req->user_data,
+                          PQNB_QUEUE_FULL == res
+                          ? "Queries queue is full\n"
+                          : "Could not queue query\n",
+                          false);
+          return res;
+        }
+      PQNB_pool_grow(pool, req);
+      PQNB_pool_arm(pool);
+      PQNB_pool_watermark(pool);
+      return 0;
+    }
+
+  PQNB_idle_remove(conn->host->idle_head, conn->host->idle_tail, conn);
+  PQNB_pool_dispatched(pool, req);
+  /* failures are notified by the connection */
+  res = 0;
+  if (NULL != req->session)
+    PQNB_session_pin(conn, req);
+  else
+    res = PQNB_connection_query(conn, req);
+  /* pipelined connections go back to the tail */
+  if (0 == res && PQNB_connection_has_slot(conn))
+    PQNB_idle_push(conn->host->idle_head, conn->host->idle_tail, conn);
+  PQNB_pool_arm(pool);
+  return res;
+}
+
+int
+PQNB_pool_submit(struct PQNB_pool *pool, struct PQNB_query_request *req,
+                 uint32_t timeout_ms)
+{
+  if (-1 == PQNB_timer_now(&pool->now))
+    return -1;
+  req->enqueued_at = pool->now;
+  return PQNB_pool_dispatch(pool, req, timeout_ms, false);
+}
+
+/*
+ * bytes of a query param value
+ */
+static size_t
+PQNB_query_value_size(const struct PQNB_query *query, int i)
+{
+  if (NULL == query->param_values || NULL == query->param_values[i])
+    return 0;
+  if (NULL != query->param_formats && 1 == query->param_formats[i])
+    return query->param_lengths[i];
+  return strlen(query->param_values[i]) + 1;
+}
+
+/*
+ * bytes PQNB_query_copy needs
+ */
+static size_t
+PQNB_query_size(const struct PQNB_query *query)
+{
+  const size_t num_params = query->num_params;
+  size_t size = strlen(query->query) + 1;
+
+  if (NULL != query->param_values)
+    size += num_params * sizeof(*query->param_values);
+  if (NULL != query->param_lengths)
+    size += num_params * sizeof(*query->param_lengths);
+  if (NULL != query->param_formats)
+    size += num_params * sizeof(*query->param_formats);
+  if (NULL != query->param_types)
+    size += num_params * sizeof(*query->param_types);
+  for (int i = 0; i < query->num_params; i++)
+    size += PQNB_query_value_size(query, i);
+  if (NULL != query->cache_channel)
+    size += strlen(query->cache_channel) + 1;
+  return size;
+}
+
+/*
+ * copies the query and params into buf, pointer aligned,
+ * and points the query at them
+ */
+static void
+PQNB_query_copy(struct PQNB_query *query, void *buf)
+{
+  const size_t num_params = query->num_params;
+  const char **values = NULL;
+  char *next = buf;
+  size_t size;
+
+  /* pointers first, then the 4 bytes arrays, then bytes */
+  if (NULL != query->param_values)
+    {
+      values = (const char**) next;
+      next += num_params * sizeof(*values);
+    }
+  if (NULL != query->param_lengths)
+    {
+      size = num_params * sizeof(*query->param_lengths);
+      query->param_lengths = memcpy(next, query->param_lengths, size);
+      next += size;
+    }
+  if (NULL != query->param_formats)
+    {
+      size = num_params * sizeof(*query->param_formats);
+      query->param_formats = memcpy(next, query->param_formats, size);
+      next += size;
+    }
+  if (NULL != query->param_types)
+    {
+      size = num_params * sizeof(*query->param_types);
+      query->param_types = memcpy(next, query->param_types, size);
+      next += size;
+    }
+  size = strlen(query->query) + 1;
+  query->query = memcpy(next, query->query, size);
+  next += size;
+  if (NULL != query->cache_channel)
+    {
+      size = strlen(query->cache_channel) + 1;
+      query->cache_channel = memcpy(next, query->cache_channel, size);
+      next += size;
+    }
+
+  if (NULL == values)
+    return;
+  for (int i = 0; i < query->num_params; i++)
+    {
+      size = PQNB_query_value_size(query, i);
+      values[i] = 0 == size
+                  ? NULL : memcpy(next, query->param_values[i], size);
+      next += size;
+    }
+  query->param_values = values;
+}
+
+void
+PQNB_pool_release(struct PQNB_pool *pool, struct PQNB_query_request *req)
+{
+  /* freed once its callbacks ran, by PQNB_pool_run */
+  if (NULL != req->flight)
+    PQNB_flight_land(req->flight);
+  req->flight = NULL;
+  if (NULL == req->owned)
+    return;
+  PQNB_slab_release(pool->arena, req->owned);
+  req->owned = NULL;
+}
+
+int
+PQNB_pool_request(struct PQNB_pool *pool, struct PQNB_query_request *req,
+                  const struct PQNB_query *user_query,
+                  PQNB_query_cb query_cb, const void *user_data)
+{
+  struct PQNB_query owned_query;
+  const struct PQNB_query *query = user_query;
+
+  if (PQNB_QUERY_COPY & user_query->flags)
+    {
+      owned_query = *user_query;
+      req->owned = PQNB_slab_alloc(pool->arena,
+                                   PQNB_query_size(&owned_query));
+      if (NULL == req->owned)
+        return -1;
+      PQNB_query_copy(&owned_query, req->owned);
+      query = &owned_query;
+    }
+  req->query = (char*) query->query;
+  req->param_types = query->param_types;
+  req->param_values = query->param_values;
+  req->param_lengths = query->param_lengths;
+  req->param_formats = query->param_formats;
+  req->num_params = query->num_params;
+  req->result_format = query->result_format;
+  req->query_class = query->query_class;
+  req->read_only = 0 != (PQNB_QUERY_READ_ONLY & query->flags);
+  if (PQNB_QUERY_STREAM & query->flags)
+    req->stream_rows = 0 < query->stream_rows ? query->stream_rows : 1;
+  else if (PQNB_QUERY_CACHE & query->flags)
+    {
+      req->cache = NULL != pool->result_cache;
+      req->cache_channel = query->cache_channel;
+    }
+  req->query_cb = query_cb;
+  req->user_data = (void*) user_data;
+  return 0;
+}
+
+/*
+ * submits the queries posted from other threads
+ */
+static void
+PQNB_pool_drain(struct PQNB_pool *pool)
+{
+  struct PQNB_mpsc_node *node;
+  struct PQNB_query_post *post;
+  uint64_t count;
+
+  while (0 < read(pool->event_fd, &count, sizeof(count)));
+  /* posts from now on write event_fd again */
+  atomic_store(&pool->wakeup_pending, false);
+
+  while (NULL != (node = PQNB_mpsc_pop(pool->posted)))
+    {
+      struct PQNB_query_request query_request = {0};
+
+      post = PQNB_container_of(node, struct PQNB_query_post, node);
+      if (PQNB_pool_cached(pool, &post->query, post->query_cb,
+                           post->user_data)
+          || PQNB_pool_joined(pool, &post->query, post->query_cb,
+                              post->user_data))
+        {
+          free(post);
+          continue;
+        }
+      if (-1 == PQNB_pool_request(pool, &query_request, &post->query,
+                                  post->query_cb, post->user_data))
+        post->query_cb(NULL, post->user_data, "Could not queue query\n",
+                       false);
+      else
+        {
+          query_request.enqueued_at = post->posted_at;
+          PQNB_pool_fly(pool, &query_request, &post->query);
+          PQNB_pool_dispatch(pool, &query_request, post->query.timeout_ms,
+                             true);
+        }
+      free(post);
+    }
+}
+
 int
 PQNB_pool_run(struct PQNB_pool *pool)
 {
-  struct PQNB_connection *conn, *next;
-  struct PQNB_query_request *query_request;
-  struct timespec ts;
-  time_t now;
+  struct PQNB_connection *conn;
   struct epoll_event events[PQNB_MAX_EVENTS];
+  uint64_t expirations;
   int num_events;
 
   num_events = PQNB_MAX_EVENTS;
 
-  if (-1 == clock_gettime(CLOCK_MONOTONIC, &ts))
+  if (-1 == PQNB_timer_now(&pool->now))
     return -1;
-  now = ts.tv_sec;
 
   while (PQNB_MAX_EVENTS == num_events)
     {
@@ -103,22 +1173,41 @@ PQNB_pool_run(struct PQNB_pool *pool)
         }
       for (int i = 0; i < num_events; i++)
         {
+          if (&pool->timer_fd == events[i].data.ptr)
+            {
+              /* draining it, deadlines are checked below */
+              while (0 < read(pool->timer_fd, &expirations,
+                              sizeof(expirations)));
+              continue;
+            }
+          if (&pool->event_fd == events[i].data.ptr)
+            {
+              PQNB_pool_drain(pool);
+              continue;
+            }
+
           conn = events[i].data.ptr;
           assert(NULL != conn);
 
-          conn->last_activity = now;
+          /* the old socket, reconnecting opens another */
+          if (CONN_BACKOFF == conn->action)
+            continue;
+
+          PQNB_connection_touch(conn);
 
           /** 
-           * if (re)connecting let the timeout reset
+           * if (re)connecting let the timeout reset, cancelling
+           * connections share events with the cancel request
+           * socket, which the server closes
            */
           if ((EPOLLERR | EPOLLRDHUP) & events[i].events
               && (CONN_RECONNECTING != conn->action
-                  && CONN_CONNECTING != conn->action))
+                  && CONN_CONNECTING != conn->action
+                  && CONN_CANCELLING != conn->action))
             {
-              conn->query_cb(NULL, conn->user_data, 
-                             "Lost connection with postgres database\n",
-                             false);
-              PQNB_connection_reset(conn);
+              PQNB_connection_fail(conn,
+                  "Lost connection with postgres database\n",
+                  false);
               continue;
             }
 
@@ -143,11 +1232,7 @@ PQNB_pool_run(struct PQNB_pool *pool)
               switch(PQconnectPoll(conn->pg_conn))
                 {
                 case PGRES_POLLING_OK:
-                  conn->poll = CONN_POLL_OK;
-                  conn->action = CONN_IDLE;
-                  conn->readable = 0;
-                  PQNB_connecting_remove(pool->connecting_head,
-                                         pool->connecting_tail, conn);
+                  PQNB_connection_connected(conn);
                   break;
                 case PGRES_POLLING_READING:
                   conn->poll = CONN_POLL_READ;
@@ -158,7 +1243,7 @@ PQNB_pool_run(struct PQNB_pool *pool)
                   conn->writable = 0;
                   break;
                 case PGRES_POLLING_FAILED:
-                  PQNB_connection_reset(conn);
+                  PQNB_connection_connect_failed(conn);
                   break;
                 default:
                   break;
@@ -181,12 +1266,7 @@ PQNB_pool_run(struct PQNB_pool *pool)
               switch(PQresetPoll(conn->pg_conn))
                 {
                 case PGRES_POLLING_OK:
-                  conn->poll = CONN_POLL_OK;
-                  conn->action = CONN_IDLE;
-                  conn->readable = 0;
-                  PQNB_connecting_remove(pool->connecting_head,
-                                         pool->connecting_tail,
-                                         conn);
+                  PQNB_connection_connected(conn);
                   break;
                 case PGRES_POLLING_READING:
                   conn->poll = CONN_POLL_READ;
@@ -196,6 +1276,9 @@ PQNB_pool_run(struct PQNB_pool *pool)
                   conn->poll = CONN_POLL_WRITE;
                   conn->writable = 0;
                   break;
+                case PGRES_POLLING_FAILED:
+                  PQNB_connection_connect_failed(conn);
+                  break;
                 default:
                   break;
                 }
@@ -207,8 +1290,8 @@ PQNB_pool_run(struct PQNB_pool *pool)
                 {
                   if (-1 == PQNB_connection_read(conn))
                     {
-                      PQNB_connection_cb_err(conn);
-                      PQNB_connection_reset(conn);
+                      PQNB_connection_fail(conn,
+                          PQerrorMessage(conn->pg_conn), false);
                       continue;
                     }
                 }
@@ -219,101 +1302,140 @@ PQNB_pool_run(struct PQNB_pool *pool)
                     conn->action = CONN_QUERYING;
                   else if (-1 == res)
                     {
-                      PQNB_connection_cb_err(conn);
-                      PQNB_connection_reset(conn);
+                      PQNB_connection_fail(conn,
+                          PQerrorMessage(conn->pg_conn), false);
                       continue;
                     }
                 }
             }
 
-          if (CONN_QUERYING == conn->action
-              && conn->readable)
+          if (CONN_COPY_IN == conn->action)
             {
-              if (-1 == PQNB_connection_read(conn))
+              /* the server may end the copy with an error */
+              if (conn->readable
+                  && -1 == PQNB_connection_read(conn))
                 {
-                  PQNB_connection_cb_err(conn);
-                  PQNB_connection_reset(conn);
+                  PQNB_connection_fail(conn,
+                      PQerrorMessage(conn->pg_conn), false);
                   continue;
                 }
-              if (0 == PQisBusy(conn->pg_conn))
+              if (conn->writable
+                  && -1 == PQNB_copy_flush(conn,
+                               PQNB_ring_buffer_tail(conn->requests)))
                 {
-                  PGresult *result = NULL;
-                  while(NULL != 
-                        (result = PQgetResult(conn->pg_conn)))
-                    {
-                      conn->query_cb(result, conn->user_data,
-                                     NULL, false);
-                      PQclear(result);
-                    }
-                  PQNB_querying_remove(pool->querying_head,
-                                       pool->querying_tail,
-                                       conn);
-                  conn->action = CONN_IDLE;
-                  PQNB_connection_clear_data(conn);
+                  PQNB_connection_fail(conn,
+                      PQerrorMessage(conn->pg_conn), false);
+                  continue;
                 }
             }
 
-          if (CONN_IDLE == conn->action
-              && conn->writable)
+          if (CONN_CANCELLING == conn->action)
+            PQNB_connection_cancel_poll(conn);
+
+          /*
+           * pipelined connections may have results
+           * before everything is flushed
+           */
+          if (CONN_QUERYING == conn->action
+              || CONN_CANCELLING == conn->action
+              || CONN_COPY_OUT == conn->action
+              || (CONN_FLUSHING == conn->action && conn->pipelined))
             {
-              if (PQNB_ring_buffer_empty(pool->queries_buffer))
+              if (conn->readable
+                  && -1 == PQNB_connection_read(conn))
                 {
-                  PQNB_idle_push(pool->idle_head,
-                                 pool->idle_tail, conn);
+                  PQNB_connection_fail(conn,
+                      PQerrorMessage(conn->pg_conn), false);
+                  continue;
                 }
-              else
+              PQNB_pool_deliver(pool, conn);
+            }
+
+          /* the listener gets notifications while idle as well */
+          if (NULL != conn->session && conn->session->listener)
+            {
+              if (CONN_IDLE == conn->action && conn->readable
+                  && -1 == PQNB_connection_read(conn))
                 {
-                  PQNB_connection_query(conn, 
-                      PQNB_ring_buffer_pop(pool->queries_buffer));
+                  PQNB_connection_fail(conn,
+                      PQerrorMessage(conn->pg_conn), false);
+                  continue;
                 }
+              PQNB_listen_dispatch(pool, conn);
             }
+
+          if (PQNB_connection_has_slot(conn))
+            PQNB_pool_fill(pool, conn);
         }
     }
 
-  next = pool->connecting_head;
-  while (NULL != (conn = next))
-    {
-      if (now - conn->last_activity < pool->connect_timeout)
-        break;
-      next = conn->next_connecting;
-      conn->last_activity = now;
-
-      /* if the connection has any assigned query, we must notify */
-      /* about the timeout */
-      if (NULL != conn->query_cb)
-        conn->query_cb(NULL, conn->user_data, NULL, true);
+  PQNB_pool_expire(pool);
+  PQNB_pool_breaker(pool);
+  PQNB_pool_arm(pool);
+  if (NULL != pool->shard)
+    PQNB_group_balance(pool->shard);
+  if (NULL != pool->flights)
+    PQNB_flights_collect(pool->flights);
+  return 0;
+}
 
-      PQNB_connection_reset(conn);
-    }
+/*
+ * counts the connections of each state, they aren't kept
+ * up to date as they only matter for stats
+ */
+static void
+PQNB_pool_gauges(struct PQNB_pool *pool)
+{
+  struct PQNB_pool_stats *stats = &pool->stats;
+  struct PQNB_connection *conn;
 
-  next = pool->querying_head;
-  while (NULL != (conn = next))
+  stats->connections = 0;
+  stats->idle = 0;
+  stats->connecting = 0;
+  stats->querying = 0;
+  stats->backoff = 0;
+  stats->in_flight = 0;
+  for (size_t i = 0; i < pool->num_hosts; i++)
     {
-      if (now - conn->last_activity < pool->query_timeout)
-        break;
-      next = conn->next_querying;
-      conn->last_activity = now;
-      conn->query_cb(NULL, conn->user_data, NULL, true);
-      /*
-       * libpq doesn't support non blocking query cancellation
-       * so we reset the connection
-       */
-      PQNB_connection_reset(conn);
+      struct PQNB_host *host = &pool->hosts[i];
+      stats->in_flight += host->in_flight;
+      for (conn = host->conns_head; NULL != conn; conn = conn->next_conn)
+        {
+          stats->connections++;
+          if (CONN_IDLE == conn->action)
+            stats->idle++;
+          else if (CONN_CONNECTING == conn->action
+                   || CONN_RECONNECTING == conn->action)
+            stats->connecting++;
+          else if (CONN_BACKOFF == conn->action)
+            stats->backoff++;
+          else
+            stats->querying++;
+        }
     }
+  stats->queued = pool->queued;
+  stats->arena_reserved = PQNB_slab_usage(pool->arena)->reserved;
+  stats->arena_used = PQNB_slab_usage(pool->arena)->used;
+  stats->arena_peak = PQNB_slab_usage(pool->arena)->peak;
+  stats->cache_bytes = NULL != pool->result_cache
+                       ? PQNB_result_cache_bytes(pool->result_cache) : 0;
+}
 
-  /* looping queries that doesn't have any assigned connection yet */
-  while(NULL != 
-        (query_request 
-         = PQNB_ring_buffer_tail(pool->queries_buffer)))
-    {
-      if (now - query_request->enqueued_at < pool->query_timeout)
-        break;
-      query_request->query_cb(NULL, query_request->user_data,
-                              NULL, true);
-      PQNB_ring_buffer_pop(pool->queries_buffer);
-    }
-  return 0;
+#ifdef PQNB_TRACE
+void
+PQNB_pool_trace(struct PQNB_pool *pool, enum PQNB_trace_event event,
+                struct PQNB_query_request *req)
+{
+  uint64_t now;
+
+  if (NULL == pool->trace_cb || -1 == PQNB_timer_now(&now))
+    return;
+  pool->trace_cb(pool, event, now, req->query,
+                 NULL != req->flight ? PQNB_flight_user_data(req->flight)
+                                     : req->user_data,
+                 pool->trace_data);
 }
+#endif
 
 const union PQNB_pool_info *
 PQNB_pool_get_info(struct PQNB_pool *pool, 
@@ -321,34 +1443,363 @@ PQNB_pool_get_info(struct PQNB_pool *pool,
 {
   if (PQNB_INFO_EPOLL_FD == info_type)
     return (const union PQNB_pool_info*) &pool->epoll_fd;
+  else if (PQNB_INFO_STATS == info_type)
+    {
+      PQNB_pool_gauges(pool);
+      return (const union PQNB_pool_info*) &pool->stats;
+    }
   else
     return NULL;
 }
 
+int
+PQNB_pool_get_class_stats(struct PQNB_pool *pool, uint8_t query_class,
+                          struct PQNB_class_stats *stats)
+{
+  if (PQNB_MAX_QUERY_CLASSES <= query_class)
+    return -1;
+  *stats = pool->classes[query_class].stats;
+  return 0;
+}
+
+int
+PQNB_pool_set_option(struct PQNB_pool *pool,
+                     enum PQNB_pool_option_type option_type,
+                     const union PQNB_pool_option *option)
+{
+  if (PQNB_OPT_PIPELINE_DEPTH == option_type)
+    {
+      if (0 == option->pipeline_depth
+          || PQNB_MAX_PIPELINE_DEPTH < option->pipeline_depth)
+        return -1;
+      pool->pipeline_depth = option->pipeline_depth;
+      return 0;
+    }
+  else if (PQNB_OPT_BATCH_SIZE == option_type)
+    {
+      if (PQNB_MAX_PIPELINE_DEPTH < option->batch_size)
+        return -1;
+      pool->batch_size = option->batch_size;
+      return 0;
+    }
+  else if (PQNB_OPT_STATEMENT_CACHE == option_type)
+    {
+      if (PQNB_MAX_STATEMENT_CACHE < option->statement_cache_size)
+        return -1;
+      pool->statement_cache_size = option->statement_cache_size;
+      return 0;
+    }
+  else if (PQNB_OPT_CONNECT_TIMEOUT_MS == option_type
+           || PQNB_OPT_QUERY_TIMEOUT_MS == option_type)
+    {
+      if (0 == option->timeout_ms)
+        return -1;
+      if (PQNB_OPT_CONNECT_TIMEOUT_MS == option_type)
+        pool->connect_timeout = option->timeout_ms * PQNB_NSEC_PER_MSEC;
+      else
+        pool->query_timeout = option->timeout_ms * PQNB_NSEC_PER_MSEC;
+      return 0;
+    }
+  else if (PQNB_OPT_QUEUE_CAPACITY == option_type)
+    {
+      if (0 == option->queue_capacity)
+        return -1;
+      pool->queue_capacity = option->queue_capacity;
+      return 0;
+    }
+  else if (PQNB_OPT_MIN_CONNECTIONS == option_type)
+    {
+      if (option->connections > pool->max_connections
+          || -1 == PQNB_timer_now(&pool->now))
+        return -1;
+      pool->min_connections = option->connections;
+      for (int h = 0; h < pool->num_hosts; h++)
+        while (pool->hosts[h].num_connections < pool->min_connections)
+          if (-1 == PQNB_pool_open(pool, &pool->hosts[h]))
+            return -1;
+      return 0;
+    }
+  else if (PQNB_OPT_MAX_CONNECTIONS == option_type)
+    {
+      if (0 == option->connections
+          || option->connections < pool->min_connections)
+        return -1;
+      pool->max_connections = option->connections;
+      return 0;
+    }
+  else if (PQNB_OPT_IDLE_TIMEOUT_MS == option_type)
+    {
+      pool->idle_timeout = option->timeout_ms * PQNB_NSEC_PER_MSEC;
+      return 0;
+    }
+  else if (PQNB_OPT_RECONNECT_BACKOFF_MS == option_type
+           || PQNB_OPT_RECONNECT_BACKOFF_MAX_MS == option_type)
+    {
+      const uint64_t backoff = option->timeout_ms * PQNB_NSEC_PER_MSEC;
+      if (0 == backoff)
+        return -1;
+      if (PQNB_OPT_RECONNECT_BACKOFF_MS == option_type
+          && backoff <= pool->backoff_max)
+        pool->backoff_min = backoff;
+      else if (PQNB_OPT_RECONNECT_BACKOFF_MAX_MS == option_type
+               && backoff >= pool->backoff_min)
+        pool->backoff_max = backoff;
+      else
+        return -1;
+      return 0;
+    }
+  else if (PQNB_OPT_MAX_RECONNECTS == option_type)
+    {
+      if (0 == option->connections)
+        return -1;
+      pool->max_reconnects = option->connections;
+      return 0;
+    }
+  else if (PQNB_OPT_GROW_THRESHOLD == option_type)
+    {
+      pool->grow_threshold = option->grow_threshold;
+      return 0;
+    }
+  else if (PQNB_OPT_CLASS_WEIGHT == option_type)
+    {
+      if (PQNB_MAX_QUERY_CLASSES <= option->class_weight.query_class
+          || 0 == option->class_weight.weight)
+        return -1;
+      pool->classes[option->class_weight.query_class].weight
+        = option->class_weight.weight;
+      return 0;
+    }
+#ifdef PQNB_TRACE
+  else if (PQNB_OPT_TRACE == option_type)
+    {
+      pool->trace_cb = option->trace.cb;
+      pool->trace_data = option->trace.user_data;
+      return 0;
+    }
+#endif
+  else if (PQNB_OPT_QUEUE_WATERMARK == option_type)
+    {
+      if (NULL != option->watermark.cb
+          && option->watermark.low >= option->watermark.high)
+        return -1;
+      pool->watermark_cb = option->watermark.cb;
+      pool->watermark_data = option->watermark.user_data;
+      pool->high_watermark = option->watermark.high;
+      pool->low_watermark = option->watermark.low;
+      pool->above_watermark = false;
+      PQNB_pool_watermark(pool);
+      return 0;
+    }
+  else if (PQNB_OPT_RESULT_CACHE == option_type)
+    {
+      if (0 == option->result_cache.max_bytes)
+        {
+          /* results being delivered are freed once released */
+          if (NULL != pool->result_cache)
+            PQNB_result_cache_free(pool->result_cache);
+          pool->result_cache = NULL;
+        }
+      else if (NULL == pool->result_cache)
+        {
+          pool->result_cache
+            = PQNB_result_cache_init(option->result_cache.max_bytes);
+          if (NULL == pool->result_cache)
+            return -1;
+        }
+      else
+        PQNB_result_cache_resize(pool->result_cache,
+                                 option->result_cache.max_bytes);
+      pool->cache_ttl = (uint64_t) option->result_cache.ttl_ms
+                        * PQNB_NSEC_PER_MSEC;
+      return 0;
+    }
+  else
+    return -1;
+}
+
 int
 PQNB_pool_query(struct PQNB_pool *pool, const char *query,
                 PQNB_query_cb query_cb, const void *user_data)
 {
-  struct PQNB_query_request query_request;
-  struct PQNB_connection *conn;
-  struct timespec ts;
+  return PQNB_pool_query_params(pool, query, 0, NULL, NULL, NULL,
+                                NULL, 0, query_cb, user_data);
+}
 
-  query_request.query = (char*) query;
-  query_request.query_cb = query_cb;
-  query_request.user_data = (void*) user_data;
+int
+PQNB_pool_query_params(struct PQNB_pool *pool, const char *query,
+                       int num_params,
+                       const Oid *param_types,
+                       const char *const *param_values,
+                       const int *param_lengths,
+                       const int *param_formats,
+                       int result_format,
+                       PQNB_query_cb query_cb,
+                       const void *user_data)
+{
+  struct PQNB_query query_ex = {0};
+
+  query_ex.query = query;
+  query_ex.param_types = param_types;
+  query_ex.param_values = param_values;
+  query_ex.param_lengths = param_lengths;
+  query_ex.param_formats = param_formats;
+  query_ex.num_params = num_params;
+  query_ex.result_format = result_format;
+  return PQNB_pool_query_ex(pool, &query_ex, query_cb, user_data);
+}
+
+int
+PQNB_pool_query_ex(struct PQNB_pool *pool, const struct PQNB_query *query,
+                   PQNB_query_cb query_cb, const void *user_data)
+{
+  struct PQNB_query_request query_request = {0};
 
-  if (-1 == clock_gettime(CLOCK_MONOTONIC, &ts))
+  if (PQNB_MAX_QUERY_CLASSES <= query->query_class)
     return -1;
-  query_request.enqueued_at = ts.tv_sec;
+  if (PQNB_pool_cached(pool, query, query_cb, user_data)
+      || PQNB_pool_joined(pool, query, query_cb, user_data))
+    return 0;
+  if (-1 == PQNB_pool_request(pool, &query_request, query,
+                              query_cb, user_data))
+    return -1;
+  PQNB_pool_fly(pool, &query_request, query);
+  return PQNB_pool_submit(pool, &query_request, query->timeout_ms);
+}
 
-  conn = pool->idle_head;
-  if (NULL == conn)
-      return PQNB_ring_buffer_push(pool->queries_buffer,
-                                   &query_request);
-  else
+void
+PQNB_pool_cache_invalidate(struct PQNB_pool *pool, const char *channel)
+{
+  if (NULL != pool->result_cache)
+    PQNB_result_cache_invalidate(pool->result_cache, channel);
+}
+
+int
+PQNB_pool_query_mt(struct PQNB_pool *pool, const struct PQNB_query *query,
+                   PQNB_query_cb query_cb, const void *user_data)
+{
+  struct PQNB_query_post *post;
+
+  if (PQNB_MAX_QUERY_CLASSES <= query->query_class)
+    return -1;
+  /* copied again into the arena by the pool thread */
+  post = malloc(sizeof(*post) + (PQNB_QUERY_COPY & query->flags
+                                 ? PQNB_query_size(query) : 0));
+  if (NULL == post)
+    return -1;
+  if (-1 == PQNB_timer_now(&post->posted_at))
     {
-      PQNB_idle_remove(pool->idle_head,
-                       pool->idle_tail, conn);
-      return PQNB_connection_query(conn, &query_request);
+      free(post);
+      return -1;
     }
+  post->query = *query;
+  if (PQNB_QUERY_COPY & query->flags)
+    PQNB_query_copy(&post->query, post->owned);
+  post->query_cb = query_cb;
+  post->user_data = (void*) user_data;
+  return PQNB_pool_post(pool, post);
+}
+
+int
+PQNB_pool_post(struct PQNB_pool *pool, struct PQNB_query_post *post)
+{
+  PQNB_mpsc_push(pool->posted, &post->node);
+  return PQNB_pool_wakeup(pool);
+}
+
+int
+PQNB_pool_wakeup(struct PQNB_pool *pool)
+{
+  const uint64_t one = 1;
+
+  /* one wakeup per drain */
+  if (!atomic_exchange(&pool->wakeup_pending, true)
+      && sizeof(one) != write(pool->event_fd, &one, sizeof(one)))
+    return -1;
+  return 0;
+}
+
+size_t
+PQNB_pool_donate(struct PQNB_pool *pool, struct PQNB_pool *to, size_t max)
+{
+  struct PQNB_query_class *qc;
+  struct PQNB_query_request *req;
+  struct PQNB_query_post *post;
+  struct PQNB_query query;
+  size_t moved = 0;
+
+  while (moved < max && NULL != (qc = PQNB_pool_next_class(pool)))
+    {
+      req = PQNB_ring_buffer_tail(qc->queue);
+      /* COPY and sessions can't be posted, flights stay with the pool */
+      if (NULL != req->copy_cb || NULL != req->session
+          || NULL != req->flight)
+        break;
+      memset(&query, 0, sizeof(query));
+      query.query = req->query;
+      query.param_types = req->param_types;
+      query.param_values = req->param_values;
+      query.param_lengths = req->param_lengths;
+      query.param_formats = req->param_formats;
+      query.num_params = req->num_params;
+      query.result_format = req->result_format;
+      query.query_class = req->query_class;
+      if (0 < req->stream_rows)
+        {
+          query.flags = PQNB_QUERY_STREAM;
+          query.stream_rows = req->stream_rows;
+        }
+      if (req->read_only)
+        query.flags |= PQNB_QUERY_READ_ONLY;
+      if (req->cache)
+        {
+          query.flags |= PQNB_QUERY_CACHE;
+          query.cache_channel = req->cache_channel;
+        }
+      /* keeps the deadline, at millisecond precision */
+      query.timeout_ms = (req->timer.deadline - req->enqueued_at)
+                         / PQNB_NSEC_PER_MSEC;
+      if (0 == query.timeout_ms)
+        query.timeout_ms = 1;
+      /* the arena block stays with this pool */
+      if (NULL != req->owned)
+        query.flags |= PQNB_QUERY_COPY;
+      post = malloc(sizeof(*post) + (NULL != req->owned
+                                     ? PQNB_query_size(&query) : 0));
+      if (NULL == post)
+        break;
+      post->query = query;
+      if (NULL != req->owned)
+        PQNB_query_copy(&post->query, post->owned);
+      post->query_cb = req->query_cb;
+      post->user_data = req->user_data;
+      post->posted_at = req->enqueued_at;
+
+      PQNB_ring_buffer_pop(qc->queue);
+      PQNB_timer_disarm(pool->queue_timers, &req->timer);
+      PQNB_pool_release(pool, req);
+      qc->deficit--;
+      qc->stats.queued--;
+      pool->queued--;
+      /* counted again by the receiving pool */
+      pool->stats.submitted--;
+      PQNB_pool_post(to, post);
+      moved++;
+    }
+  PQNB_pool_watermark(pool);
+  return moved;
+}
+
+int
+PQNB_pool_copy(struct PQNB_pool *pool, const char *query,
+               PQNB_copy_cb copy_cb,
+               PQNB_query_cb query_cb, const void *user_data)
+{
+  struct PQNB_query_request query_request = {0};
+
+  query_request.query = (char*) query;
+  query_request.copy_cb = copy_cb;
+  query_request.query_cb = query_cb;
+  query_request.user_data = (void*) user_data;
+
+  return PQNB_pool_submit(pool, &query_request, 0);
 }
@@ -0,0 +1,327 @@
+#include "result_cache.h"
+
+#include <libpq-fe.h>
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * power of two, lookups of a few thousand cached
+ * results keep chains short
+ */
+#define PQNB_RESULT_BUCKETS 4096
+
+struct PQNB_result_cache
+{
+  struct PQNB_result_entry *buckets[PQNB_RESULT_BUCKETS];
+  /*
+   * most recently used
+   */
+  struct PQNB_result_entry *lru_head;
+  /*
+   * least recently used, first to be evicted
+   */
+  struct PQNB_result_entry *lru_tail;
+  size_t bytes;
+  size_t max_bytes;
+};
+
+/*
+ * param value bytes, -1 for NULL
+ */
+static int
+PQNB_result_value_len(const struct PQNB_query *query, int i)
+{
+  if (NULL == query->param_values || NULL == query->param_values[i])
+    return -1;
+  if (NULL != query->param_formats && 1 == query->param_formats[i])
+    return query->param_lengths[i];
+  return (int) strlen(query->param_values[i]);
+}
+
+size_t
+PQNB_result_key_size(const struct PQNB_query *query)
+{
+  size_t size = 2 * sizeof(int) + strlen(query->query);
+
+  for (int i = 0; i < query->num_params; i++)
+    {
+      const int len = PQNB_result_value_len(query, i);
+      size += sizeof(Oid) + 2 * sizeof(int) + (0 < len ? len : 0);
+    }
+  return size;
+}
+
+/*
+ * result format, params count, then type, format, length and
+ * bytes of each param, then the sql query. Absent types and
+ * formats are written as 0
+ */
+void
+PQNB_result_key_write(const struct PQNB_query *query, char *key)
+{
+  memcpy(key, &query->result_format, sizeof(int));
+  key += sizeof(int);
+  memcpy(key, &query->num_params, sizeof(int));
+  key += sizeof(int);
+  for (int i = 0; i < query->num_params; i++)
+    {
+      const Oid type = NULL != query->param_types
+                       ? query->param_types[i] : 0;
+      const int format = NULL != query->param_formats
+                         ? query->param_formats[i] : 0;
+      const int len = PQNB_result_value_len(query, i);
+
+      memcpy(key, &type, sizeof(type));
+      key += sizeof(type);
+      memcpy(key, &format, sizeof(format));
+      key += sizeof(format);
+      memcpy(key, &len, sizeof(len));
+      key += sizeof(len);
+      if (0 < len)
+        {
+          memcpy(key, query->param_values[i], len);
+          key += len;
+        }
+    }
+  memcpy(key, query->query, strlen(query->query));
+}
+
+char *
+PQNB_result_key(const struct PQNB_query *query, char *stack,
+                size_t *key_len)
+{
+  char *key = stack;
+
+  *key_len = PQNB_result_key_size(query);
+  if (PQNB_RESULT_KEY_STACK < *key_len)
+    {
+      key = malloc(*key_len);
+      if (NULL == key)
+        return NULL;
+    }
+  PQNB_result_key_write(query, key);
+  return key;
+}
+
+/*
+ * FNV-1a
+ */
+uint64_t
+PQNB_result_hash(const char *key, size_t key_len)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t i = 0; i < key_len; i++)
+    {
+      hash ^= (unsigned char) key[i];
+      hash *= 1099511628211ULL;
+    }
+  return hash;
+}
+
+static void
+PQNB_result_lru_unlink(struct PQNB_result_cache *cache,
+                       struct PQNB_result_entry *entry)
+{
+  if (NULL == entry->prev_lru)
+    cache->lru_head = entry->next_lru;
+  else
+    entry->prev_lru->next_lru = entry->next_lru;
+  if (NULL == entry->next_lru)
+    cache->lru_tail = entry->prev_lru;
+  else
+    entry->next_lru->prev_lru = entry->prev_lru;
+  entry->prev_lru = NULL;
+  entry->next_lru = NULL;
+}
+
+static void
+PQNB_result_lru_push(struct PQNB_result_cache *cache,
+                     struct PQNB_result_entry *entry)
+{
+  entry->prev_lru = NULL;
+  entry->next_lru = cache->lru_head;
+  if (NULL == cache->lru_head)
+    cache->lru_tail = entry;
+  else
+    cache->lru_head->prev_lru = entry;
+  cache->lru_head = entry;
+}
+
+static struct PQNB_result_entry **
+PQNB_result_find(struct PQNB_result_cache *cache, const char *key,
+                 size_t key_len, uint64_t hash)
+{
+  struct PQNB_result_entry **link;
+
+  link = &cache->buckets[hash & (PQNB_RESULT_BUCKETS - 1)];
+  while (NULL != *link)
+    {
+      if (hash == (*link)->hash && key_len == (*link)->key_len
+          && 0 == memcmp((*link)->key, key, key_len))
+        break;
+      link = &(*link)->next_bucket;
+    }
+  return link;
+}
+
+static void
+PQNB_result_drop(struct PQNB_result_cache *cache,
+                 struct PQNB_result_entry *entry)
+{
+  struct PQNB_result_entry **link;
+
+  link = PQNB_result_find(cache, entry->key, entry->key_len, entry->hash);
+  *link = entry->next_bucket;
+  PQNB_result_lru_unlink(cache, entry);
+  cache->bytes -= entry->size;
+  PQNB_result_cache_release(entry);
+}
+
+/*
+ * evicts the least recently used entries until bytes fit
+ */
+static void
+PQNB_result_evict(struct PQNB_result_cache *cache, size_t bytes)
+{
+  while (NULL != cache->lru_tail && cache->bytes + bytes > cache->max_bytes)
+    PQNB_result_drop(cache, cache->lru_tail);
+}
+
+struct PQNB_result_cache *
+PQNB_result_cache_init(size_t max_bytes)
+{
+  struct PQNB_result_cache *cache = calloc(1, sizeof(*cache));
+
+  if (NULL == cache)
+    return NULL;
+  cache->max_bytes = max_bytes;
+  return cache;
+}
+
+void
+PQNB_result_cache_free(struct PQNB_result_cache *cache)
+{
+  struct PQNB_result_entry *entry, *next;
+
+  for (entry = cache->lru_head; NULL != entry; entry = next)
+    {
+      next = entry->next_lru;
+      PQNB_result_cache_release(entry);
+    }
+  free(cache);
+}
+
+void
+PQNB_result_cache_resize(struct PQNB_result_cache *cache, size_t max_bytes)
+{
+  cache->max_bytes = max_bytes;
+  PQNB_result_evict(cache, 0);
+}
+
+struct PQNB_result_entry *
+PQNB_result_cache_get(struct PQNB_result_cache *cache,
+                      const struct PQNB_query *query, uint64_t now)
+{
+  char stack[PQNB_RESULT_KEY_STACK], *key;
+  struct PQNB_result_entry *entry;
+  size_t key_len;
+
+  key = PQNB_result_key(query, stack, &key_len);
+  if (NULL == key)
+    return NULL;
+  entry = *PQNB_result_find(cache, key, key_len,
+                            PQNB_result_hash(key, key_len));
+  if (stack != key)
+    free(key);
+  if (NULL == entry)
+    return NULL;
+  if (0 != entry->expires_at && entry->expires_at <= now)
+    {
+      PQNB_result_drop(cache, entry);
+      return NULL;
+    }
+  if (cache->lru_head != entry)
+    {
+      PQNB_result_lru_unlink(cache, entry);
+      PQNB_result_lru_push(cache, entry);
+    }
+  entry->refs++;
+  return entry;
+}
+
+void
+PQNB_result_cache_release(struct PQNB_result_entry *entry)
+{
+  if (0 < --entry->refs)
+    return;
+  PQclear(entry->result);
+  free(entry);
+}
+
+struct PQNB_result_entry *
+PQNB_result_cache_put(struct PQNB_result_cache *cache,
+                      const struct PQNB_query *query, const char *channel,
+                      PGresult *result, uint64_t expires_at)
+{
+  const size_t channel_len = NULL != channel ? strlen(channel) + 1 : 0;
+  struct PQNB_result_entry *entry, **link;
+  size_t key_len, size;
+
+  key_len = PQNB_result_key_size(query);
+  size = sizeof(*entry) + key_len + channel_len
+         + PQresultMemorySize(result);
+  if (size > cache->max_bytes)
+    return NULL;
+  entry = malloc(sizeof(*entry) + key_len + channel_len);
+  if (NULL == entry)
+    return NULL;
+  PQNB_result_key_write(query, entry->key);
+  entry->key_len = key_len;
+  entry->hash = PQNB_result_hash(entry->key, key_len);
+  entry->expires_at = expires_at;
+  entry->result = result;
+  entry->channel = NULL;
+  if (NULL != channel)
+    entry->channel = memcpy(entry->key + key_len, channel, channel_len);
+  entry->size = size;
+  /* the cache and the caller */
+  entry->refs = 2;
+
+  /* a concurrent miss of the same query */
+  link = PQNB_result_find(cache, entry->key, key_len, entry->hash);
+  if (NULL != *link)
+    PQNB_result_drop(cache, *link);
+  PQNB_result_evict(cache, size);
+
+  link = &cache->buckets[entry->hash & (PQNB_RESULT_BUCKETS - 1)];
+  entry->next_bucket = *link;
+  *link = entry;
+  PQNB_result_lru_push(cache, entry);
+  cache->bytes += size;
+  return entry;
+}
+
+void
+PQNB_result_cache_invalidate(struct PQNB_result_cache *cache,
+                             const char *channel)
+{
+  struct PQNB_result_entry *entry, *next;
+
+  for (entry = cache->lru_head; NULL != entry; entry = next)
+    {
+      next = entry->next_lru;
+      if (NULL == channel
+          || (NULL != entry->channel && 0 == strcmp(entry->channel, channel)))
+        PQNB_result_drop(cache, entry);
+    }
+}
+
+size_t
+PQNB_result_cache_bytes(const struct PQNB_result_cache *cache)
+{
+  return cache->bytes;
+}
@@ -0,0 +1,141 @@
+#ifndef PQNB_RESULT_CACHE_H
+#define PQNB_RESULT_CACHE_H
+
+#include "pqnb.h"
+
+#include <libpq-fe.h>
+
+#include <stddef.h>
+#include <inttypes.h>
+
+struct PQNB_result_entry
+{
+  /*
+   * hash of the key
+   */
+  uint64_t hash;
+  /*
+   * CLOCK_MONOTONIC nanoseconds, 0 if it doesn't expire
+   */
+  uint64_t expires_at;
+  /*
+   * shared by every hit, never modified
+   */
+  PGresult *result;
+  /*
+   * NOTIFY channel invalidating it, NULL if none
+   */
+  char *channel;
+  /*
+   * bytes counted against the cache size
+   */
+  size_t size;
+  /*
+   * one for the cache, one per result being delivered
+   */
+  uint32_t refs;
+  /*
+   * next entry on the same hash bucket
+   */
+  struct PQNB_result_entry *next_bucket;
+  /*
+   * more / less recently used entries
+   */
+  struct PQNB_result_entry *prev_lru;
+  struct PQNB_result_entry *next_lru;
+  /*
+   * serialized query and params, followed by the channel
+   */
+  size_t key_len;
+  char key[];
+};
+
+/*
+ * keys up to this size are serialized on the stack
+ */
+#define PQNB_RESULT_KEY_STACK 512
+
+/*
+ * bytes of the query and params key
+ */
+size_t
+PQNB_result_key_size(const struct PQNB_query *query);
+
+/*
+ * serializes the key into key_size bytes
+ */
+void
+PQNB_result_key_write(const struct PQNB_query *query, char *key);
+
+/*
+ * serializes the key into stack, of PQNB_RESULT_KEY_STACK bytes,
+ * if it fits, malloc'ed otherwise. NULL on allocation errors
+ */
+char *
+PQNB_result_key(const struct PQNB_query *query, char *stack,
+                size_t *key_len);
+
+uint64_t
+PQNB_result_hash(const char *key, size_t key_len);
+
+/*
+ * results keyed by query and params, least recently used ones
+ * are evicted above the cache size. Single threaded
+ */
+struct PQNB_result_cache;
+
+/*
+ * NULL on allocation errors
+ */
+struct PQNB_result_cache *
+PQNB_result_cache_init(size_t max_bytes);
+
+/*
+ * entries still being delivered are freed once released
+ */
+void
+PQNB_result_cache_free(struct PQNB_result_cache *cache);
+
+/*
+ * evicts down to the new size
+ */
+void
+PQNB_result_cache_resize(struct PQNB_result_cache *cache, size_t max_bytes);
+
+/*
+ * NULL if not cached or expired, marks it as the most recently
+ * used. The entry must be released once its result is delivered
+ */
+struct PQNB_result_entry *
+PQNB_result_cache_get(struct PQNB_result_cache *cache,
+                      const struct PQNB_query *query, uint64_t now);
+
+void
+PQNB_result_cache_release(struct PQNB_result_entry *entry);
+
+/*
+ * caches the result, replacing the one of the same key, channel
+ * may be NULL. The key is copied, the query may be freed once it
+ * returns. The entry must be released once its result is delivered,
+ * like a hit. NULL if it is too large or on allocation errors, the
+ * result is then left to the caller
+ */
+struct PQNB_result_entry *
+PQNB_result_cache_put(struct PQNB_result_cache *cache,
+                      const struct PQNB_query *query, const char *channel,
+                      PGresult *result, uint64_t expires_at);
+
+/*
+ * drops the entries of the channel, every entry if NULL
+ */
+void
+PQNB_result_cache_invalidate(struct PQNB_result_cache *cache,
+                             const char *channel);
+
+/*
+ * bytes held by the cached entries
+ */
+size_t
+PQNB_result_cache_bytes(const struct PQNB_result_cache *cache);
+
+#endif /* ~PQNB_RESULT_CACHE_H */
@@ -7,33 +7,51 @@
 
 struct PQNB_ring_buffer
 {
-  void *buffer;     
-  void *buffer_end; 
+  char *buffer;
+  /*
+   * power of two, indexes are masked with capacity - 1
+   */
   size_t capacity;
-  size_t count;  
-  size_t sz;     
-  void *head;
-  void *tail;
+  size_t count;
+  size_t sz;
+  /*
+   * next push index
+   */
+  size_t head;
+  /*
+   * oldest value index
+   */
+  size_t tail;
 };
 
+static size_t
+PQNB_ring_buffer_pow2(size_t n)
+{
+  size_t capacity = 1;
+
+  while (capacity < n)
+    capacity <<= 1;
+  return capacity;
+}
+
 struct PQNB_ring_buffer *
 PQNB_ring_buffer_init(size_t capacity, size_t sz)
 {
   struct PQNB_ring_buffer *ring_buffer = malloc(sizeof(*ring_buffer));
   if (NULL == ring_buffer)
     return NULL;
+  capacity = PQNB_ring_buffer_pow2(capacity);
   ring_buffer->buffer = malloc(capacity * sz);
   if(ring_buffer->buffer == NULL)
     {
       free(ring_buffer);
       return NULL;
     }
-  ring_buffer->buffer_end = (char *) ring_buffer->buffer + capacity * sz;
   ring_buffer->capacity = capacity;
   ring_buffer->count = 0;
   ring_buffer->sz = sz;
-  ring_buffer->head = ring_buffer->buffer;
-  ring_buffer->tail = ring_buffer->buffer;
+  ring_buffer->head = 0;
+  ring_buffer->tail = 0;
   return ring_buffer;
 }
 
@@ -56,15 +74,55 @@ PQNB_ring_buffer_not_empty(struct PQNB_ring_buffer *ring_buffer)
   return 0 < ring_buffer->count;
 }
 
+size_t
+PQNB_ring_buffer_count(struct PQNB_ring_buffer *ring_buffer)
+{
+  return ring_buffer->count;
+}
+
+size_t
+PQNB_ring_buffer_capacity(struct PQNB_ring_buffer *ring_buffer)
+{
+  return ring_buffer->capacity;
+}
+
+int
+PQNB_ring_buffer_grow(struct PQNB_ring_buffer *ring_buffer)
+{
+  const size_t capacity = 2 * ring_buffer->capacity;
+  const size_t first = ring_buffer->capacity - ring_buffer->tail;
+  char *buffer;
+
+  buffer = malloc(capacity * ring_buffer->sz);
+  if (NULL == buffer)
+    return -1;
+  /* unwrapping, values start at index 0 on the new buffer */
+  if (first >= ring_buffer->count)
+    memcpy(buffer, ring_buffer->buffer + ring_buffer->tail * ring_buffer->sz,
+           ring_buffer->count * ring_buffer->sz);
+  else
+    {
+      memcpy(buffer, ring_buffer->buffer + ring_buffer->tail * ring_buffer->sz,
+             first * ring_buffer->sz);
+      memcpy(buffer + first * ring_buffer->sz, ring_buffer->buffer,
+             (ring_buffer->count - first) * ring_buffer->sz);
+    }
+  free(ring_buffer->buffer);
+  ring_buffer->buffer = buffer;
+  ring_buffer->capacity = capacity;
+  ring_buffer->tail = 0;
+  ring_buffer->head = ring_buffer->count;
+  return 0;
+}
+
 int
 PQNB_ring_buffer_push(struct PQNB_ring_buffer *ring_buffer, const void *item)
 {
   if(ring_buffer->count == ring_buffer->capacity)
     return -1;
-  memcpy(ring_buffer->head, item, ring_buffer->sz);
-  ring_buffer->head = (char*) ring_buffer->head + ring_buffer->sz;
-  if(ring_buffer->head == ring_buffer->buffer_end)
-    ring_buffer->head = ring_buffer->buffer;
+  memcpy(ring_buffer->buffer + ring_buffer->head * ring_buffer->sz,
+         item, ring_buffer->sz);
+  ring_buffer->head = (ring_buffer->head + 1) & (ring_buffer->capacity - 1);
   ring_buffer->count++;
   return 0;
 }
@@ -74,10 +132,8 @@ PQNB_ring_buffer_pop(struct PQNB_ring_buffer *ring_buffer)
 {
   if(0 == ring_buffer->count)
     return NULL;
-  void *item = ring_buffer->tail;
-  ring_buffer->tail = (char*) ring_buffer->tail + ring_buffer->sz;
-  if(ring_buffer->tail == ring_buffer->buffer_end)
-    ring_buffer->tail = ring_buffer->buffer;
+  void *item = ring_buffer->buffer + ring_buffer->tail * ring_buffer->sz;
+  ring_buffer->tail = (ring_buffer->tail + 1) & (ring_buffer->capacity - 1);
   ring_buffer->count--;
   return item;
 }
@@ -87,5 +143,25 @@ PQNB_ring_buffer_tail(struct PQNB_ring_buffer *ring_buffer)
 {
   if (0 == ring_buffer->count)
     return NULL;
-  return ring_buffer->tail;
+  return ring_buffer->buffer + ring_buffer->tail * ring_buffer->sz;
+}
+
+void *
+PQNB_ring_buffer_last(struct PQNB_ring_buffer *ring_buffer)
+{
+  if (0 == ring_buffer->count)
+    return NULL;
+  return ring_buffer->buffer
+    + ((ring_buffer->head - 1) & (ring_buffer->capacity - 1))
+      * ring_buffer->sz;
+}
+
+void *
+PQNB_ring_buffer_at(struct PQNB_ring_buffer *ring_buffer, size_t i)
+{
+  if (i >= ring_buffer->count)
+    return NULL;
+  return ring_buffer->buffer
+    + ((ring_buffer->tail + i) & (ring_buffer->capacity - 1))
+      * ring_buffer->sz;
 }
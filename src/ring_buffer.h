@@ -6,6 +6,9 @@
 
 struct PQNB_ring_buffer;
 
+/*
+ * capacity is rounded up to a power of two
+ */
 struct PQNB_ring_buffer*
 PQNB_ring_buffer_init(size_t capacity, size_t sz);
 
@@ -18,6 +21,19 @@ PQNB_ring_buffer_empty(struct PQNB_ring_buffer *cb);
 bool
 PQNB_ring_buffer_not_empty(struct PQNB_ring_buffer *cb);
 
+size_t
+PQNB_ring_buffer_count(struct PQNB_ring_buffer *cb);
+
+size_t
+PQNB_ring_buffer_capacity(struct PQNB_ring_buffer *cb);
+
+/*
+ * doubles the capacity, values are moved so pointers
+ * to them are invalidated. returns -1 on allocation errors
+ */
+int
+PQNB_ring_buffer_grow(struct PQNB_ring_buffer *cb);
+
 int
 PQNB_ring_buffer_push(struct PQNB_ring_buffer *cb, const void *item);
 
@@ -30,4 +46,16 @@ PQNB_ring_buffer_pop(struct PQNB_ring_buffer *cb);
 void*
 PQNB_ring_buffer_tail(struct PQNB_ring_buffer *cb);
 
+/*
+ * last pushed value, do not pops it
+ */
+void*
+PQNB_ring_buffer_last(struct PQNB_ring_buffer *cb);
+
+/*
+ * i-th value from the tail, NULL if out of range
+ */
+void*
+PQNB_ring_buffer_at(struct PQNB_ring_buffer *cb, size_t i);
+
 #endif /* ~PQNB_RING_BUFFER_H */
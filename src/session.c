@@ -0,0 +1,305 @@
+#include "pqnb.h"
+
+#include "internal.h"
+#include "connection.h"
+#include "session.h"
+#include "listen.h"
+
+#include <libpq-fe.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * pending queries initial entries, it doubles as needed
+ */
+#define PQNB_SESSION_PENDING_INITIAL 8
+
+/*
+ * BEGIN / end results without a callback, failures
+ * show up on the following queries
+ */
+static void
+PQNB_session_ignore(PGresult *result, void *user_data,
+                    char *error_msg, bool timeout)
+{
+  (void) result;
+  (void) user_data;
+  (void) error_msg;
+  (void) timeout;
+}
+
+static void
+PQNB_session_free(struct PQNB_session *session)
+{
+  struct PQNB_pool *pool = session->pool;
+  struct PQNB_query_request *req;
+
+  while (NULL != (req = PQNB_ring_buffer_pop(session->pending)))
+    PQNB_pool_release(pool, req);
+  PQNB_ring_buffer_free(session->pending);
+  if (NULL == session->prev)
+    pool->sessions = session->next;
+  else
+    session->prev->next = session->next;
+  if (NULL != session->next)
+    session->next->prev = session->prev;
+  free(session);
+}
+
+/*
+ * frees the session once nothing refers to it anymore
+ */
+static void
+PQNB_session_done(struct PQNB_session *session)
+{
+  if (session->ended && !session->acquiring && !session->notifying
+      && NULL == session->conn
+      && PQNB_ring_buffer_empty(session->pending))
+    PQNB_session_free(session);
+}
+
+void
+PQNB_session_fail(struct PQNB_session *session,
+                  const char *error_msg, bool timeout)
+{
+  struct PQNB_pool *pool = session->pool;
+  struct PQNB_query_request *pending, req;
+
+  session->failed = 1;
+  session->notifying = 1;
+  while (NULL != (pending = PQNB_ring_buffer_pop(session->pending)))
+    {
+      req = *pending;
+      PQNB_pool_release(pool, &req);
+      if (timeout)
+        pool->stats.timeouts++;
+      else
+        pool->stats.errors++;
+      req.query_cb(NULL, req.user_data, (char*) error_msg, timeout);
+    }
+  session->notifying = 0;
+  if (session->listener)
+    PQNB_listen_lost(session);
+  PQNB_session_done(session);
+}
+
+/*
+ * the acquire request timed out or was refused while queued
+ */
+static void
+PQNB_session_acquire_failed(PGresult *result, void *user_data,
+                            char *error_msg, bool timeout)
+{
+  struct PQNB_session *session = user_data;
+
+  (void) result;
+  session->acquiring = 0;
+  PQNB_session_fail(session, error_msg, timeout);
+}
+
+/*
+ * if the pinned connection can take one more query, always
+ * pipelined whatever the pool pipeline depth
+ */
+static bool
+PQNB_session_accepts(struct PQNB_connection *conn)
+{
+  if (CONN_IDLE == conn->action)
+    return true;
+  if (CONN_QUERYING != conn->action && CONN_FLUSHING != conn->action)
+    return false;
+  return conn->pipelined
+    && PQNB_ring_buffer_count(conn->requests) < PQNB_MAX_PIPELINE_DEPTH;
+}
+
+/*
+ * queues the query until the connection takes it.
+ * returns 0 on success, -1 on error
+ */
+static int
+PQNB_session_push(struct PQNB_session *session,
+                  const struct PQNB_query *query,
+                  PQNB_query_cb query_cb, const void *user_data)
+{
+  struct PQNB_pool *pool = session->pool;
+  struct PQNB_query_request query_request = {0};
+
+  if (-1 == PQNB_timer_now(&pool->now))
+    return -1;
+  if (PQNB_ring_buffer_count(session->pending)
+      == PQNB_ring_buffer_capacity(session->pending)
+      && -1 == PQNB_ring_buffer_grow(session->pending))
+    return -1;
+  if (-1 == PQNB_pool_request(pool, &query_request, query,
+                              query_cb, user_data))
+    return -1;
+  query_request.query_class = 0;
+  query_request.read_only = 0;
+  query_request.cache = 0;
+  query_request.enqueued_at = pool->now;
+  query_request.timer.index = PQNB_TIMER_DISARMED;
+  query_request.timer.deadline = pool->now
+    + (0 < query->timeout_ms ? query->timeout_ms * PQNB_NSEC_PER_MSEC
+                             : pool->query_timeout);
+  PQNB_ring_buffer_push(session->pending, &query_request);
+  pool->stats.submitted++;
+  return 0;
+}
+
+void
+PQNB_session_pin(struct PQNB_connection *conn,
+                 struct PQNB_query_request *req)
+{
+  struct PQNB_session *session = req->session;
+
+  session->acquiring = 0;
+  session->conn = conn;
+  conn->session = session;
+  /* acquiring isn't a query */
+  conn->pool->stats.submitted--;
+  /* pinned connections aren't reaped */
+  conn->deadline = 0;
+  PQNB_connection_schedule(conn);
+  PQNB_session_resume(session);
+}
+
+void
+PQNB_session_resume(struct PQNB_session *session)
+{
+  struct PQNB_connection *conn = session->conn;
+  struct PQNB_pool *pool = session->pool;
+  struct PQNB_query_request *pending, req;
+  bool listener, sent = false;
+
+  if (NULL == conn)
+    return;
+  while (NULL != (pending = PQNB_ring_buffer_tail(session->pending))
+         && PQNB_session_accepts(conn))
+    {
+      req = *pending;
+      PQNB_ring_buffer_pop(session->pending);
+      /* failing the connection fails the session, it may be freed */
+      if (-1 == PQNB_connection_send(conn, &req))
+        return;
+      sent = true;
+    }
+  /* whatever was sent goes out at once */
+  if (sent && CONN_FLUSHING == conn->action
+      && -1 == PQNB_connection_flush(conn))
+    return;
+
+  if (!session->ended || CONN_IDLE != conn->action
+      || !PQNB_ring_buffer_empty(session->pending))
+    return;
+  listener = session->listener;
+  conn->session = NULL;
+  session->conn = NULL;
+  PQNB_session_free(session);
+  /* rolls back whatever the session left open, or stops listening */
+  if (listener || PQTRANS_IDLE != PQtransactionStatus(conn->pg_conn))
+    {
+      PQNB_connection_reset(conn);
+      return;
+    }
+  PQNB_connection_idle(conn);
+  PQNB_connection_schedule(conn);
+  PQNB_pool_fill(pool, conn);
+}
+
+void
+PQNB_session_free_all(struct PQNB_pool *pool)
+{
+  while (NULL != pool->sessions)
+    PQNB_session_free(pool->sessions);
+}
+
+struct PQNB_session *
+PQNB_pool_session(struct PQNB_pool *pool, uint32_t flags,
+                  uint32_t timeout_ms)
+{
+  struct PQNB_query_request query_request = {0};
+  struct PQNB_session *session = calloc(1, sizeof(*session));
+
+  if (NULL == session)
+    return NULL;
+  session->pending = PQNB_ring_buffer_init(PQNB_SESSION_PENDING_INITIAL,
+                                           sizeof(query_request));
+  if (NULL == session->pending)
+    {
+      free(session);
+      return NULL;
+    }
+  session->pool = pool;
+  session->next = pool->sessions;
+  if (NULL != pool->sessions)
+    pool->sessions->prev = session;
+  pool->sessions = session;
+
+  /* queued and dispatched like a COPY, it needs an idle connection */
+  session->acquiring = 1;
+  query_request.session = session;
+  query_request.query_cb = PQNB_session_acquire_failed;
+  query_request.user_data = session;
+  if (0 != PQNB_pool_submit(pool, &query_request, timeout_ms))
+    {
+      PQNB_session_free(session);
+      return NULL;
+    }
+
+  if (PQNB_SESSION_TRANSACTION & flags)
+    {
+      const struct PQNB_query begin = { .query = "BEGIN" };
+      if (-1 == PQNB_session_push(session, &begin,
+                                  PQNB_session_ignore, NULL))
+        {
+          PQNB_session_end(session, false, NULL, NULL);
+          return NULL;
+        }
+      session->flags = flags;
+      PQNB_session_resume(session);
+    }
+  return session;
+}
+
+int
+PQNB_session_query(struct PQNB_session *session,
+                   const struct PQNB_query *query,
+                   PQNB_query_cb query_cb, const void *user_data)
+{
+  if (session->failed || session->ended
+      || -1 == PQNB_session_push(session, query, query_cb, user_data))
+    return -1;
+  PQNB_session_resume(session);
+  return 0;
+}
+
+int
+PQNB_session_end(struct PQNB_session *session, bool commit,
+                 PQNB_query_cb query_cb, const void *user_data)
+{
+  int res = 0;
+
+  if (PQNB_SESSION_TRANSACTION & session->flags)
+    {
+      const struct PQNB_query end = {
+        .query = commit && !session->failed ? "COMMIT" : "ROLLBACK",
+      };
+      /*
+       * a lost connection took the transaction along, one
+       * that can't be ended is reset when given back
+       */
+      if ((NULL == session->conn && !session->acquiring)
+          || -1 == PQNB_session_push(session, &end,
+                                     NULL != query_cb
+                                     ? query_cb : PQNB_session_ignore,
+                                     user_data))
+        res = -1;
+    }
+  session->ended = 1;
+  if (NULL != session->conn)
+    PQNB_session_resume(session);
+  else
+    PQNB_session_done(session);
+  return res;
+}
@@ -0,0 +1,35 @@
+#ifndef PQNB_SESSION_H
+#define PQNB_SESSION_H
+
+#include "internal.h"
+
+/*
+ * pins the connection to the session acquiring it
+ * and sends the queries submitted meanwhile
+ */
+void
+PQNB_session_pin(struct PQNB_connection *conn,
+                 struct PQNB_query_request *req);
+
+/*
+ * sends the pending queries the connection can take, gives it
+ * back to the pool once the session ended and they completed
+ */
+void
+PQNB_session_resume(struct PQNB_session *session);
+
+/*
+ * refuses queries from now on and fails the pending ones,
+ * frees the session if it ended and lost its connection
+ */
+void
+PQNB_session_fail(struct PQNB_session *session,
+                  const char *error_msg, bool timeout);
+
+/*
+ * PQNB_pool_free only, pending queries are dropped
+ */
+void
+PQNB_session_free_all(struct PQNB_pool *pool);
+
+#endif /* ~PQNB_SESSION_H */
@@ -0,0 +1,167 @@
+#include "slab.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * precedes every block handed out
+ */
+struct PQNB_slab_block
+{
+  union
+  {
+    struct
+    {
+      /*
+       * free list while free, oversized blocks list otherwise
+       */
+      struct PQNB_slab_block *next;
+      struct PQNB_slab_block *prev;
+      /*
+       * PQNB_SLAB_CLASSES if oversized
+       */
+      size_t size_class;
+      size_t size;
+    };
+    max_align_t align;
+  };
+};
+
+struct PQNB_slab_chunk
+{
+  union
+  {
+    struct PQNB_slab_chunk *next;
+    max_align_t align;
+  };
+};
+
+struct PQNB_slab
+{
+  struct PQNB_slab_block *free[PQNB_SLAB_CLASSES];
+  struct PQNB_slab_chunk *chunks;
+  struct PQNB_slab_block *oversized;
+  struct PQNB_slab_usage usage;
+};
+
+struct PQNB_slab *
+PQNB_slab_init(void)
+{
+  return calloc(1, sizeof(struct PQNB_slab));
+}
+
+void
+PQNB_slab_free(struct PQNB_slab *slab)
+{
+  struct PQNB_slab_chunk *chunk;
+  struct PQNB_slab_block *block;
+
+  while (NULL != (chunk = slab->chunks))
+    {
+      slab->chunks = chunk->next;
+      free(chunk);
+    }
+  while (NULL != (block = slab->oversized))
+    {
+      slab->oversized = block->next;
+      free(block);
+    }
+  free(slab);
+}
+
+/*
+ * threads a new chunk of size_class blocks on its free list.
+ * returns 0 on success, -1 on allocation errors
+ */
+static int
+PQNB_slab_grow(struct PQNB_slab *slab, size_t size_class)
+{
+  const size_t size = (size_t) PQNB_SLAB_MIN_BLOCK << size_class;
+  struct PQNB_slab_chunk *chunk = malloc(PQNB_SLAB_CHUNK);
+  char *block;
+
+  if (NULL == chunk)
+    return -1;
+  chunk->next = slab->chunks;
+  slab->chunks = chunk;
+  slab->usage.reserved += PQNB_SLAB_CHUNK;
+
+  for (block = (char*) (chunk + 1);
+       block + size <= (char*) chunk + PQNB_SLAB_CHUNK; block += size)
+    {
+      struct PQNB_slab_block *free_block = (struct PQNB_slab_block*) block;
+      free_block->size_class = size_class;
+      free_block->size = size;
+      free_block->next = slab->free[size_class];
+      slab->free[size_class] = free_block;
+    }
+  return 0;
+}
+
+void *
+PQNB_slab_alloc(struct PQNB_slab *slab, size_t size)
+{
+  struct PQNB_slab_block *block;
+  size_t size_class = 0;
+
+  size += sizeof(*block);
+  while (size_class < PQNB_SLAB_CLASSES
+         && (size_t) PQNB_SLAB_MIN_BLOCK << size_class < size)
+    size_class++;
+
+  if (PQNB_SLAB_CLASSES == size_class)
+    {
+      block = malloc(size);
+      if (NULL == block)
+        return NULL;
+      block->size_class = PQNB_SLAB_CLASSES;
+      block->size = size;
+      block->prev = NULL;
+      block->next = slab->oversized;
+      if (NULL != slab->oversized)
+        slab->oversized->prev = block;
+      slab->oversized = block;
+      slab->usage.reserved += size;
+    }
+  else
+    {
+      if (NULL == slab->free[size_class]
+          && -1 == PQNB_slab_grow(slab, size_class))
+        return NULL;
+      block = slab->free[size_class];
+      slab->free[size_class] = block->next;
+    }
+
+  slab->usage.used += block->size;
+  if (slab->usage.used > slab->usage.peak)
+    slab->usage.peak = slab->usage.used;
+  return block + 1;
+}
+
+void
+PQNB_slab_release(struct PQNB_slab *slab, void *ptr)
+{
+  struct PQNB_slab_block *block = (struct PQNB_slab_block*) ptr - 1;
+
+  slab->usage.used -= block->size;
+  if (PQNB_SLAB_CLASSES == block->size_class)
+    {
+      if (NULL == block->prev)
+        slab->oversized = block->next;
+      else
+        block->prev->next = block->next;
+      if (NULL != block->next)
+        block->next->prev = block->prev;
+      slab->usage.reserved -= block->size;
+      free(block);
+      return;
+    }
+  block->next = slab->free[block->size_class];
+  slab->free[block->size_class] = block;
+}
+
+const struct PQNB_slab_usage *
+PQNB_slab_usage(const struct PQNB_slab *slab)
+{
+  return &slab->usage;
+}
@@ -0,0 +1,67 @@
+#ifndef PQNB_SLAB_H
+#define PQNB_SLAB_H
+
+#include <stddef.h>
+
+/*
+ * power of two block sizes, headers included
+ */
+#define PQNB_SLAB_MIN_BLOCK 128
+#define PQNB_SLAB_MAX_BLOCK 8192
+#define PQNB_SLAB_CLASSES 7
+/*
+ * blocks of a class are carved from chunks of this size,
+ * kept until the slab is freed
+ */
+#define PQNB_SLAB_CHUNK (64 * 1024)
+
+/*
+ * bytes, blocks count their whole class size
+ */
+struct PQNB_slab_usage
+{
+  /*
+   * taken from malloc, chunks and oversized blocks
+   */
+  size_t reserved;
+  /*
+   * in blocks handed out
+   */
+  size_t used;
+  /*
+   * highest used
+   */
+  size_t peak;
+};
+
+/*
+ * size class free lists, single threaded. Blocks larger than
+ * PQNB_SLAB_MAX_BLOCK are malloc'ed on their own
+ */
+struct PQNB_slab;
+
+struct PQNB_slab *
+PQNB_slab_init(void);
+
+/*
+ * frees the blocks still handed out as well
+ */
+void
+PQNB_slab_free(struct PQNB_slab *slab);
+
+/*
+ * max_align_t aligned, NULL on allocation errors
+ */
+void *
+PQNB_slab_alloc(struct PQNB_slab *slab, size_t size);
+
+/*
+ * back to its class free list
+ */
+void
+PQNB_slab_release(struct PQNB_slab *slab, void *block);
+
+const struct PQNB_slab_usage *
+PQNB_slab_usage(const struct PQNB_slab *slab);
+
+#endif /* ~PQNB_SLAB_H */
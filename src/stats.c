@@ -0,0 +1,82 @@
+#include "stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * buckets are 1024ns wide up to 16 units, then each power
+ * of two is split in 16 linear sub-buckets, ~6% precision
+ */
+#define PQNB_HISTOGRAM_UNIT_SHIFT 10
+#define PQNB_HISTOGRAM_SUB_SHIFT 4
+#define PQNB_HISTOGRAM_SUB (1 << PQNB_HISTOGRAM_SUB_SHIFT)
+
+void
+PQNB_histogram_record(struct PQNB_histogram *histogram, uint64_t ns)
+{
+  const uint64_t value = ns >> PQNB_HISTOGRAM_UNIT_SHIFT;
+  size_t index;
+
+  if (value < PQNB_HISTOGRAM_SUB)
+    index = value;
+  else
+    {
+      const int shift = 63 - __builtin_clzll(value)
+                        - PQNB_HISTOGRAM_SUB_SHIFT;
+      index = (size_t) (shift + 1) * PQNB_HISTOGRAM_SUB
+              + ((value >> shift) & (PQNB_HISTOGRAM_SUB - 1));
+      if (index >= PQNB_HISTOGRAM_BUCKETS)
+        index = PQNB_HISTOGRAM_BUCKETS - 1;
+    }
+  histogram->buckets[index]++;
+  histogram->count++;
+  histogram->sum_ns += ns;
+  if (ns > histogram->max_ns)
+    histogram->max_ns = ns;
+}
+
+/*
+ * highest value of the bucket in nanoseconds
+ */
+static uint64_t
+PQNB_histogram_value(size_t index)
+{
+  uint64_t value, width;
+
+  if (index < PQNB_HISTOGRAM_SUB)
+    {
+      value = index;
+      width = 1;
+    }
+  else
+    {
+      const size_t shift = index / PQNB_HISTOGRAM_SUB - 1;
+      value = (uint64_t) (PQNB_HISTOGRAM_SUB + index % PQNB_HISTOGRAM_SUB)
+              << shift;
+      width = 1ULL << shift;
+    }
+  return ((value + width) << PQNB_HISTOGRAM_UNIT_SHIFT) - 1;
+}
+
+uint64_t
+PQNB_histogram_percentile(const struct PQNB_histogram *histogram,
+                          double percentile)
+{
+  uint64_t rank, seen = 0;
+
+  if (0 == histogram->count)
+    return 0;
+  if (percentile >= 100.0)
+    return histogram->max_ns;
+  rank = (uint64_t) (percentile / 100.0 * histogram->count);
+  for (size_t i = 0; i < PQNB_HISTOGRAM_BUCKETS; i++)
+    {
+      seen += histogram->buckets[i];
+      if (seen > rank)
+        {
+          const uint64_t value = PQNB_histogram_value(i);
+          return value < histogram->max_ns ? value : histogram->max_ns;
+        }
+    }
+  return histogram->max_ns;
+}
@@ -0,0 +1,14 @@
+#ifndef PQNB_STATS_H
+#define PQNB_STATS_H
+
+#include "pqnb.h"
+
+#include <stdint.h>
+
+/*
+ * adds a nanoseconds sample, constant time
+ */
+void
+PQNB_histogram_record(struct PQNB_histogram *histogram, uint64_t ns);
+
+#endif /* ~PQNB_STATS_H */
@@ -0,0 +1,246 @@
+#include "stmt_cache.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * power of two, a few hundred statements per
+ * connection keeps chains short
+ */
+#define PQNB_STMT_BUCKETS 1024
+
+struct PQNB_stmt_cache
+{
+  struct PQNB_stmt *buckets[PQNB_STMT_BUCKETS];
+  /*
+   * most recently used
+   */
+  struct PQNB_stmt *lru_head;
+  /*
+   * least recently used, first to be evicted
+   */
+  struct PQNB_stmt *lru_tail;
+  size_t count;
+  /*
+   * used for naming statements, names are never reused
+   * so a late prepare can't clash with a newer one
+   */
+  uint64_t next_id;
+};
+
+static Oid
+PQNB_stmt_type(const Oid *param_types, int i)
+{
+  return NULL != param_types ? param_types[i] : 0;
+}
+
+/*
+ * FNV-1a of the query, then of each param type
+ */
+static uint64_t
+PQNB_stmt_hash(const char *query, int num_params, const Oid *param_types)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (; '\0' != *query; query++)
+    {
+      hash ^= (unsigned char) *query;
+      hash *= 1099511628211ULL;
+    }
+  for (int i = 0; i < num_params; i++)
+    {
+      hash ^= PQNB_stmt_type(param_types, i);
+      hash *= 1099511628211ULL;
+    }
+  return hash;
+}
+
+static bool
+PQNB_stmt_matches(const struct PQNB_stmt *stmt, const char *query,
+                  int num_params, const Oid *param_types)
+{
+  if (num_params != stmt->num_params || 0 != strcmp(stmt->query, query))
+    return false;
+  for (int i = 0; i < num_params; i++)
+    if (stmt->param_types[i] != PQNB_stmt_type(param_types, i))
+      return false;
+  return true;
+}
+
+static void
+PQNB_stmt_lru_unlink(struct PQNB_stmt_cache *cache, struct PQNB_stmt *stmt)
+{
+  if (NULL == stmt->prev_lru)
+    cache->lru_head = stmt->next_lru;
+  else
+    stmt->prev_lru->next_lru = stmt->next_lru;
+  if (NULL == stmt->next_lru)
+    cache->lru_tail = stmt->prev_lru;
+  else
+    stmt->next_lru->prev_lru = stmt->prev_lru;
+  stmt->prev_lru = NULL;
+  stmt->next_lru = NULL;
+}
+
+static void
+PQNB_stmt_lru_push(struct PQNB_stmt_cache *cache, struct PQNB_stmt *stmt)
+{
+  stmt->prev_lru = NULL;
+  stmt->next_lru = cache->lru_head;
+  if (NULL == cache->lru_head)
+    cache->lru_tail = stmt;
+  else
+    cache->lru_head->prev_lru = stmt;
+  cache->lru_head = stmt;
+}
+
+static struct PQNB_stmt **
+PQNB_stmt_find(struct PQNB_stmt_cache *cache, const char *query,
+               int num_params, const Oid *param_types, uint64_t hash)
+{
+  struct PQNB_stmt **link;
+
+  link = &cache->buckets[hash & (PQNB_STMT_BUCKETS - 1)];
+  while (NULL != *link)
+    {
+      if (hash == (*link)->hash
+          && PQNB_stmt_matches(*link, query, num_params, param_types))
+        break;
+      link = &(*link)->next_bucket;
+    }
+  return link;
+}
+
+static void
+PQNB_stmt_drop(struct PQNB_stmt_cache *cache, struct PQNB_stmt **link)
+{
+  struct PQNB_stmt *stmt = *link;
+
+  *link = stmt->next_bucket;
+  PQNB_stmt_lru_unlink(cache, stmt);
+  cache->count--;
+  free(stmt->query);
+  free(stmt);
+}
+
+struct PQNB_stmt_cache *
+PQNB_stmt_cache_init(void)
+{
+  return calloc(1, sizeof(struct PQNB_stmt_cache));
+}
+
+void
+PQNB_stmt_cache_free(struct PQNB_stmt_cache *cache)
+{
+  struct PQNB_stmt *stmt, *next;
+
+  for (stmt = cache->lru_head; NULL != stmt; stmt = next)
+    {
+      next = stmt->next_lru;
+      free(stmt->query);
+      free(stmt);
+    }
+  free(cache);
+}
+
+struct PQNB_stmt *
+PQNB_stmt_cache_get(struct PQNB_stmt_cache *cache, const char *query,
+                    int num_params, const Oid *param_types)
+{
+  struct PQNB_stmt *stmt;
+
+  stmt = *PQNB_stmt_find(cache, query, num_params, param_types,
+                         PQNB_stmt_hash(query, num_params, param_types));
+  if (NULL != stmt && cache->lru_head != stmt)
+    {
+      PQNB_stmt_lru_unlink(cache, stmt);
+      PQNB_stmt_lru_push(cache, stmt);
+    }
+  return stmt;
+}
+
+struct PQNB_stmt *
+PQNB_stmt_cache_add(struct PQNB_stmt_cache *cache, const char *query,
+                    int num_params, const Oid *param_types,
+                    size_t capacity, char *deallocate,
+                    size_t deallocate_len)
+{
+  struct PQNB_stmt *stmt, *lru;
+  const uint64_t hash = PQNB_stmt_hash(query, num_params, param_types);
+
+  deallocate[0] = '\0';
+  while (0 < cache->count && capacity <= cache->count)
+    {
+      lru = cache->lru_tail;
+      /*
+       * a single prepared statement can be dropped per call,
+       * a lowered capacity is reached over the next calls
+       */
+      if (lru->prepared || lru->preparing)
+        {
+          if ('\0' != deallocate[0])
+            break;
+          snprintf(deallocate, deallocate_len, "DEALLOCATE %s", lru->name);
+        }
+      PQNB_stmt_drop(cache, PQNB_stmt_find(cache, lru->query,
+                                           lru->num_params,
+                                           lru->param_types, lru->hash));
+    }
+
+  stmt = calloc(1, sizeof(*stmt) + num_params * sizeof(Oid));
+  if (NULL == stmt)
+    return NULL;
+  stmt->query = strdup(query);
+  if (NULL == stmt->query)
+    {
+      free(stmt);
+      return NULL;
+    }
+  stmt->hash = hash;
+  stmt->num_params = num_params;
+  stmt->param_types = (Oid*) (stmt + 1);
+  for (int i = 0; i < num_params; i++)
+    stmt->param_types[i] = PQNB_stmt_type(param_types, i);
+  stmt->id = cache->next_id++;
+  snprintf(stmt->name, sizeof(stmt->name), "pqnb_%" PRIu64, stmt->id);
+
+  struct PQNB_stmt **bucket
+    = &cache->buckets[hash & (PQNB_STMT_BUCKETS - 1)];
+  stmt->next_bucket = *bucket;
+  *bucket = stmt;
+  PQNB_stmt_lru_push(cache, stmt);
+  cache->count++;
+  return stmt;
+}
+
+void
+PQNB_stmt_cache_prepared(struct PQNB_stmt_cache *cache, const char *query,
+                         int num_params, const Oid *param_types,
+                         uint64_t id, bool ok)
+{
+  struct PQNB_stmt **link;
+
+  link = PQNB_stmt_find(cache, query, num_params, param_types,
+                        PQNB_stmt_hash(query, num_params, param_types));
+  if (NULL == *link || id != (*link)->id || !(*link)->preparing)
+    return;
+  (*link)->preparing = false;
+  (*link)->prepared = ok;
+  /* prepared again by the next request */
+  if (!ok)
+    PQNB_stmt_drop(cache, link);
+}
+
+void
+PQNB_stmt_cache_invalidate(struct PQNB_stmt_cache *cache)
+{
+  for (struct PQNB_stmt *stmt = cache->lru_head;
+       NULL != stmt; stmt = stmt->next_lru)
+    {
+      stmt->prepared = false;
+      stmt->preparing = false;
+    }
+}
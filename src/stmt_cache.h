@@ -0,0 +1,108 @@
+#ifndef PQNB_STMT_CACHE_H
+#define PQNB_STMT_CACHE_H
+
+#include <libpq-fe.h>
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+/*
+ * statement names are "pqnb_" followed by a 64 bits counter
+ */
+#define PQNB_STMT_NAME_LEN 32
+
+struct PQNB_stmt
+{
+  /*
+   * hash of the sql query and param types
+   */
+  uint64_t hash;
+  /*
+   * owned copy of the sql query
+   */
+  char *query;
+  /*
+   * param types it was prepared with, absent ones as 0,
+   * in the same block as the statement
+   */
+  int num_params;
+  Oid *param_types;
+  /*
+   * next statement on the same hash bucket
+   */
+  struct PQNB_stmt *next_bucket;
+  /*
+   * more recently used statement
+   */
+  struct PQNB_stmt *prev_lru;
+  /*
+   * less recently used statement
+   */
+  struct PQNB_stmt *next_lru;
+  /*
+   * server side name, "pqnb_" followed by the id
+   */
+  uint64_t id;
+  char name[PQNB_STMT_NAME_LEN];
+  /*
+   * if the prepare succeeded on the current session
+   */
+  bool prepared;
+  /*
+   * if the prepare was sent on the current session,
+   * its outcome isn't known yet
+   */
+  bool preparing;
+};
+
+struct PQNB_stmt_cache;
+
+struct PQNB_stmt_cache *
+PQNB_stmt_cache_init(void);
+
+void
+PQNB_stmt_cache_free(struct PQNB_stmt_cache *cache);
+
+/*
+ * statements are keyed by query and param types, a NULL
+ * param_types array is the same as all types being 0
+ */
+
+/*
+ * NULL if not cached, marks it as the most recently used
+ */
+struct PQNB_stmt *
+PQNB_stmt_cache_get(struct PQNB_stmt_cache *cache, const char *query,
+                    int num_params, const Oid *param_types);
+
+/*
+ * caches a new unprepared statement, evicting the least recently used
+ * one if there are capacity statements already. If the evicted one was
+ * prepared or being prepared, deallocate is filled with the sql for
+ * dropping it, it is set to an empty string otherwise. NULL on
+ * allocation errors
+ */
+struct PQNB_stmt *
+PQNB_stmt_cache_add(struct PQNB_stmt_cache *cache, const char *query,
+                    int num_params, const Oid *param_types,
+                    size_t capacity, char *deallocate,
+                    size_t deallocate_len);
+
+/*
+ * the prepare of the statement id completed, the statement is marked
+ * as prepared, or dropped if it failed. Ignored if it was evicted or
+ * the session was reset since
+ */
+void
+PQNB_stmt_cache_prepared(struct PQNB_stmt_cache *cache, const char *query,
+                         int num_params, const Oid *param_types,
+                         uint64_t id, bool ok);
+
+/*
+ * marks every statement as unprepared, used after reconnecting
+ */
+void
+PQNB_stmt_cache_invalidate(struct PQNB_stmt_cache *cache);
+
+#endif /* ~PQNB_STMT_CACHE_H */
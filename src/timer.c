@@ -0,0 +1,167 @@
+#include "timer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct PQNB_timer_heap
+{
+  struct PQNB_timer **timers;
+  size_t capacity;
+  size_t count;
+};
+
+static void
+PQNB_timer_place(struct PQNB_timer_heap *heap, struct PQNB_timer *timer,
+                 size_t index)
+{
+  heap->timers[index] = timer;
+  timer->index = index;
+}
+
+static void
+PQNB_timer_sift_up(struct PQNB_timer_heap *heap, size_t index)
+{
+  struct PQNB_timer *timer = heap->timers[index];
+
+  while (0 < index)
+    {
+      const size_t parent = (index - 1) / 2;
+      if (heap->timers[parent]->deadline <= timer->deadline)
+        break;
+      PQNB_timer_place(heap, heap->timers[parent], index);
+      index = parent;
+    }
+  PQNB_timer_place(heap, timer, index);
+}
+
+static void
+PQNB_timer_sift_down(struct PQNB_timer_heap *heap, size_t index)
+{
+  struct PQNB_timer *timer = heap->timers[index];
+
+  for (;;)
+    {
+      size_t child = 2 * index + 1;
+      if (child >= heap->count)
+        break;
+      if (child + 1 < heap->count
+          && heap->timers[child + 1]->deadline
+             < heap->timers[child]->deadline)
+        child++;
+      if (timer->deadline <= heap->timers[child]->deadline)
+        break;
+      PQNB_timer_place(heap, heap->timers[child], index);
+      index = child;
+    }
+  PQNB_timer_place(heap, timer, index);
+}
+
+struct PQNB_timer_heap *
+PQNB_timer_heap_init(size_t capacity)
+{
+  struct PQNB_timer_heap *heap = malloc(sizeof(*heap));
+  if (NULL == heap)
+    return NULL;
+  if (0 == capacity)
+    capacity = 1;
+  heap->timers = malloc(capacity * sizeof(*heap->timers));
+  if (NULL == heap->timers)
+    {
+      free(heap);
+      return NULL;
+    }
+  heap->capacity = capacity;
+  heap->count = 0;
+  return heap;
+}
+
+void
+PQNB_timer_heap_free(struct PQNB_timer_heap *heap)
+{
+  free(heap->timers);
+  free(heap);
+}
+
+int
+PQNB_timer_reserve(struct PQNB_timer_heap *heap, size_t capacity)
+{
+  struct PQNB_timer **timers;
+  size_t grown = heap->capacity;
+
+  if (capacity <= heap->capacity)
+    return 0;
+  while (grown < capacity)
+    grown *= 2;
+  timers = realloc(heap->timers, grown * sizeof(*timers));
+  if (NULL == timers)
+    return -1;
+  heap->timers = timers;
+  heap->capacity = grown;
+  return 0;
+}
+
+void
+PQNB_timer_moved(struct PQNB_timer_heap *heap, struct PQNB_timer *timer)
+{
+  if (PQNB_TIMER_DISARMED != timer->index)
+    heap->timers[timer->index] = timer;
+}
+
+int
+PQNB_timer_arm(struct PQNB_timer_heap *heap, struct PQNB_timer *timer,
+               uint64_t deadline)
+{
+  if (PQNB_TIMER_DISARMED != timer->index)
+    {
+      const uint64_t previous = timer->deadline;
+      timer->deadline = deadline;
+      if (deadline < previous)
+        PQNB_timer_sift_up(heap, timer->index);
+      else
+        PQNB_timer_sift_down(heap, timer->index);
+      return 0;
+    }
+
+  if (heap->count == heap->capacity
+      && -1 == PQNB_timer_reserve(heap, 2 * heap->capacity))
+    return -1;
+  timer->deadline = deadline;
+  heap->timers[heap->count] = timer;
+  PQNB_timer_sift_up(heap, heap->count++);
+  return 0;
+}
+
+void
+PQNB_timer_disarm(struct PQNB_timer_heap *heap, struct PQNB_timer *timer)
+{
+  const size_t index = timer->index;
+
+  if (PQNB_TIMER_DISARMED == index)
+    return;
+  timer->index = PQNB_TIMER_DISARMED;
+  if (--heap->count == index)
+    return;
+  struct PQNB_timer *last = heap->timers[heap->count];
+  PQNB_timer_place(heap, last, index);
+  PQNB_timer_sift_up(heap, index);
+  PQNB_timer_sift_down(heap, last->index);
+}
+
+struct PQNB_timer *
+PQNB_timer_top(struct PQNB_timer_heap *heap)
+{
+  return 0 == heap->count ? NULL : heap->timers[0];
+}
+
+int
+PQNB_timer_now(uint64_t *now)
+{
+  struct timespec ts;
+
+  if (-1 == clock_gettime(CLOCK_MONOTONIC, &ts))
+    return -1;
+  *now = (uint64_t) ts.tv_sec * PQNB_NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+  return 0;
+}
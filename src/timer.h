@@ -0,0 +1,75 @@
+#ifndef PQNB_TIMER_H
+#define PQNB_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PQNB_TIMER_DISARMED SIZE_MAX
+
+#define PQNB_NSEC_PER_MSEC 1000000ULL
+#define PQNB_NSEC_PER_SEC 1000000000ULL
+
+/*
+ * embedded in whatever needs a deadline
+ */
+struct PQNB_timer
+{
+  /*
+   * CLOCK_MONOTONIC nanoseconds
+   */
+  uint64_t deadline;
+  /*
+   * position on the heap, PQNB_TIMER_DISARMED if not armed
+   */
+  size_t index;
+};
+
+/*
+ * binary min-heap of timers
+ */
+struct PQNB_timer_heap;
+
+struct PQNB_timer_heap *
+PQNB_timer_heap_init(size_t capacity);
+
+void
+PQNB_timer_heap_free(struct PQNB_timer_heap *heap);
+
+/*
+ * makes room for capacity armed timers.
+ * returns 0 on success, -1 on allocation errors
+ */
+int
+PQNB_timer_reserve(struct PQNB_timer_heap *heap, size_t capacity);
+
+/*
+ * an armed timer was copied to a new address, keeps the heap
+ * pointing to it
+ */
+void
+PQNB_timer_moved(struct PQNB_timer_heap *heap, struct PQNB_timer *timer);
+
+/*
+ * arms the timer or moves an armed one to the new deadline.
+ * returns 0 on success, -1 on allocation errors
+ */
+int
+PQNB_timer_arm(struct PQNB_timer_heap *heap, struct PQNB_timer *timer,
+               uint64_t deadline);
+
+void
+PQNB_timer_disarm(struct PQNB_timer_heap *heap, struct PQNB_timer *timer);
+
+/*
+ * earliest timer, NULL if none is armed
+ */
+struct PQNB_timer *
+PQNB_timer_top(struct PQNB_timer_heap *heap);
+
+/*
+ * CLOCK_MONOTONIC nanoseconds. returns 0 on success, -1 on error
+ */
+int
+PQNB_timer_now(uint64_t *now);
+
+#endif /* ~PQNB_TIMER_H */